@@ -0,0 +1,500 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Throughput and latency benchmark for the virtual RTC.
+ *
+ * Runs 1..N threads pinned to CPUs, each of them hammering the device with
+ * the selected operation, and reports ops/sec and latency percentiles for
+ * every thread count.
+ *
+ * The load mode instead loads and unloads the module with 1, 2, 4, ... up to
+ * N instances and reports how long that takes. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/rtc.h>
+
+#include "virtrtc_uapi.h"
+
+/* Latencies are kept in a log-linear histogram: every power of two is split
+ * into 1 << SUB_BITS buckets, which gives ~6% precision. */
+#define SUB_BITS 4
+#define NR_BUCKETS (64 << SUB_BITS)
+
+enum mode {
+	MODE_READ,
+	MODE_SET,
+	MODE_MMAP,
+	MODE_LOAD,
+};
+
+static const char *const mode_names[] = {
+	[MODE_READ] = "read",
+	[MODE_SET] = "set",
+	[MODE_MMAP] = "mmap",
+	[MODE_LOAD] = "load",
+};
+
+static struct {
+	const char *rtc_path;
+	const char *page_path;
+	unsigned int instance;
+	unsigned int max_threads;
+	unsigned int duration;
+	const char *module_path;
+	const char *module_params;
+	unsigned int max_instances;
+	enum mode mode;
+} opts = {
+	.rtc_path = "/dev/rtc0",
+	.page_path = "/dev/virtrtc",
+	.instance = 0,
+	.max_threads = 1,
+	.duration = 5,
+	.module_path = "virtrtc.ko",
+	.module_params = "",
+	.max_instances = 1024,
+	.mode = MODE_READ,
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int cpu;
+	uint64_t ops;
+	uint64_t hist[NR_BUCKETS];
+};
+
+static atomic_bool stop;
+static pthread_barrier_t start_barrier;
+static const volatile struct virtrtc_time_page *time_page;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int bucket_of(uint64_t ns)
+{
+	if (ns < (1 << SUB_BITS)) {
+		return ns;
+	}
+	unsigned int log = 63 - __builtin_clzll(ns);
+	unsigned int sub = (ns >> (log - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+	return ((log - SUB_BITS + 1) << SUB_BITS) | sub;
+}
+
+static uint64_t bucket_floor(unsigned int bucket)
+{
+	if (bucket < (1 << SUB_BITS)) {
+		return bucket;
+	}
+	unsigned int log = (bucket >> SUB_BITS) + SUB_BITS - 1;
+	uint64_t sub = bucket & ((1 << SUB_BITS) - 1);
+	return (1ULL << log) | (sub << (log - SUB_BITS));
+}
+
+static clockid_t page_clock(uint32_t timebase)
+{
+	switch (timebase) {
+	case VIRTRTC_TIMEBASE_RAW:
+		return CLOCK_MONOTONIC_RAW;
+	case VIRTRTC_TIMEBASE_REAL:
+		return CLOCK_REALTIME;
+	case VIRTRTC_TIMEBASE_BOOT:
+		return CLOCK_BOOTTIME;
+	default:
+		return CLOCK_MONOTONIC;
+	}
+}
+
+/* Returns the virtual time in nanoseconds, as described in virtrtc_uapi.h. */
+static int64_t read_page(void)
+{
+	uint32_t seq = 0;
+	uint32_t timebase = 0;
+	int64_t last_time = 0;
+	uint64_t last_base = 0;
+	uint64_t last_mono = 0;
+	uint32_t mult = 0;
+	uint32_t shift = 0;
+
+	do {
+		seq = time_page->seq;
+		atomic_thread_fence(memory_order_acquire);
+		timebase = time_page->timebase;
+		last_time = time_page->last_time;
+		last_base = time_page->last_base;
+		last_mono = time_page->last_mono;
+		mult = time_page->mult;
+		shift = time_page->shift;
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || seq != time_page->seq);
+
+	struct timespec ts;
+	clock_gettime(page_clock(timebase), &ts);
+	uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	uint64_t elapsed = timebase == VIRTRTC_TIMEBASE_JIFFIES ?
+				   now - last_mono :
+				   now - last_base;
+	return last_time +
+	       (int64_t)(((unsigned __int128)elapsed * mult) >> shift);
+}
+
+static int do_op(int fd)
+{
+	struct rtc_time tm;
+
+	switch (opts.mode) {
+	case MODE_READ:
+		return ioctl(fd, RTC_RD_TIME, &tm);
+	case MODE_SET: {
+		/* Same as hwclock --systohc. */
+		time_t t = time(NULL);
+		struct tm utc;
+		gmtime_r(&t, &utc);
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_sec = utc.tm_sec;
+		tm.tm_min = utc.tm_min;
+		tm.tm_hour = utc.tm_hour;
+		tm.tm_mday = utc.tm_mday;
+		tm.tm_mon = utc.tm_mon;
+		tm.tm_year = utc.tm_year;
+		return ioctl(fd, RTC_SET_TIME, &tm);
+	}
+	case MODE_MMAP: {
+		volatile int64_t t = read_page();
+		(void)t;
+		return 0;
+	}
+	case MODE_LOAD:
+		break;
+	}
+	return -1;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	int fd = -1;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		fprintf(stderr, "failed to pin a thread to CPU %u\n", w->cpu);
+	}
+
+	if (opts.mode != MODE_MMAP) {
+		fd = open(opts.rtc_path, O_RDONLY);
+		if (fd < 0) {
+			perror(opts.rtc_path);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		uint64_t start = now_ns();
+		if (do_op(fd) < 0) {
+			perror(mode_names[opts.mode]);
+			exit(EXIT_FAILURE);
+		}
+		w->hist[bucket_of(now_ns() - start)]++;
+		w->ops++;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	return NULL;
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p)
+{
+	uint64_t target = (uint64_t)(total * p);
+	uint64_t seen = 0;
+	unsigned int i = 0;
+
+	for (i = 0; i < NR_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > target) {
+			return bucket_floor(i);
+		}
+	}
+	return bucket_floor(NR_BUCKETS - 1);
+}
+
+static void run(unsigned int nr_threads, const cpu_set_t *cpus)
+{
+	struct worker *workers = calloc(nr_threads, sizeof(*workers));
+	uint64_t hist[NR_BUCKETS] = { 0 };
+	uint64_t total = 0;
+	unsigned int cpu = 0;
+	unsigned int i = 0;
+
+	if (!workers) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	atomic_store(&stop, false);
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i++) {
+		while (!CPU_ISSET(cpu % CPU_SETSIZE, cpus)) {
+			cpu++;
+		}
+		workers[i].cpu = cpu++ % CPU_SETSIZE;
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+				   &workers[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	uint64_t start = now_ns();
+	sleep(opts.duration);
+	atomic_store(&stop, true);
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	uint64_t elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	for (i = 0; i < nr_threads; i++) {
+		unsigned int b = 0;
+		for (b = 0; b < NR_BUCKETS; b++) {
+			hist[b] += workers[i].hist[b];
+		}
+		total += workers[i].ops;
+	}
+
+	printf("%-6s %7u %14.0f %10llu %10llu %10llu\n", mode_names[opts.mode],
+	       nr_threads, total * 1e9 / elapsed,
+	       (unsigned long long)percentile(hist, total, 0.50),
+	       (unsigned long long)percentile(hist, total, 0.99),
+	       (unsigned long long)percentile(hist, total, 0.999));
+
+	free(workers);
+}
+
+/* Whether the instance is fully created: its attributes come last. */
+static bool instance_ready(unsigned int id)
+{
+	char path[64];
+	struct stat st;
+
+	snprintf(path, sizeof(path),
+		 "/sys/bus/platform/devices/virtrtc.%u/offset", id);
+	return stat(path, &st) == 0;
+}
+
+static void run_load(unsigned int nr_instances)
+{
+	char params[256];
+
+	snprintf(params, sizeof(params), "instances=%u %s", nr_instances,
+		 opts.module_params);
+
+	int fd = open(opts.module_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(opts.module_path);
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t start = now_ns();
+	if (syscall(SYS_finit_module, fd, params, 0) != 0) {
+		perror("finit_module");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t loaded = now_ns();
+	close(fd);
+
+	/* With async_register, the instances keep coming after the load. */
+	unsigned int id = 0;
+	while (id < nr_instances) {
+		if (instance_ready(id)) {
+			id++;
+		} else {
+			usleep(100);
+		}
+	}
+	uint64_t ready = now_ns();
+
+	if (syscall(SYS_delete_module, "virtrtc", O_NONBLOCK) != 0) {
+		perror("delete_module");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t unloaded = now_ns();
+
+	printf("%-6s %9u %10.3f %10.3f %10.3f\n", mode_names[opts.mode],
+	       nr_instances, (loaded - start) / 1e6, (ready - start) / 1e6,
+	       (unloaded - ready) / 1e6);
+}
+
+static void print_timebase(void)
+{
+	char buf[32] = "unknown";
+	FILE *f = fopen("/sys/module/virtrtc/parameters/timebase", "r");
+	if (f) {
+		if (fgets(buf, sizeof(buf), f)) {
+			buf[strcspn(buf, "\n")] = '\0';
+		}
+		fclose(f);
+	}
+	printf("# timebase: %s\n", buf);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-m read|set|mmap] [-d /dev/rtcN] [-p /dev/virtrtc]\n"
+		"          [-i instance] [-t max_threads] [-s seconds]\n"
+		"       %s -m load [-k virtrtc.ko] [-n max_instances] [-o params]\n"
+		"\n"
+		"  -m  operation: RTC_RD_TIME, RTC_SET_TIME or a read of the\n"
+		"      mapped time page (default: read)\n"
+		"  -d  rtc device for read and set (default: /dev/rtc0)\n"
+		"  -p  device with the time pages (default: /dev/virtrtc)\n"
+		"  -i  instance whose time page is read (default: 0)\n"
+		"  -t  run with 1..max_threads threads (default: 1)\n"
+		"  -s  duration of every run in seconds (default: 5)\n"
+		"  -k  module to load (default: virtrtc.ko)\n"
+		"  -n  load with 1, 2, 4, ... max_instances instances (default: 1024)\n"
+		"  -o  more module parameters, e.g. async_register=1\n"
+		"\n"
+		"The set mode overwrites the time of the device with the system time.\n"
+		"The load mode needs the module to be unloaded.\n",
+		prog, prog);
+}
+
+static unsigned int parse_uint(const char *s, const char *prog)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long val = strtoul(s, &end, 0);
+	if (errno || *end != '\0' || val > UINT32_MAX) {
+		usage(prog);
+		exit(EXIT_FAILURE);
+	}
+	return val;
+}
+
+int main(int argc, char **argv)
+{
+	int opt = 0;
+	unsigned int i = 0;
+
+	while ((opt = getopt(argc, argv, "m:d:p:i:t:s:k:n:o:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (i = 0; i < sizeof(mode_names) / sizeof(*mode_names); i++) {
+				if (strcmp(optarg, mode_names[i]) == 0) {
+					break;
+				}
+			}
+			if (i == sizeof(mode_names) / sizeof(*mode_names)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			opts.mode = i;
+			break;
+		case 'd':
+			opts.rtc_path = optarg;
+			break;
+		case 'p':
+			opts.page_path = optarg;
+			break;
+		case 'i':
+			opts.instance = parse_uint(optarg, argv[0]);
+			break;
+		case 't':
+			opts.max_threads = parse_uint(optarg, argv[0]);
+			break;
+		case 's':
+			opts.duration = parse_uint(optarg, argv[0]);
+			break;
+		case 'k':
+			opts.module_path = optarg;
+			break;
+		case 'n':
+			opts.max_instances = parse_uint(optarg, argv[0]);
+			break;
+		case 'o':
+			opts.module_params = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (opts.max_threads < 1 || opts.duration < 1 || opts.max_instances < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (opts.mode == MODE_LOAD) {
+		printf("%-6s %9s %10s %10s %10s\n", "# mode", "instances",
+		       "load_ms", "ready_ms", "unload_ms");
+		for (i = 1; i <= opts.max_instances; i *= 2) {
+			run_load(i);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.mode == MODE_MMAP) {
+		int fd = open(opts.page_path, O_RDONLY);
+		if (fd < 0) {
+			perror(opts.page_path);
+			return EXIT_FAILURE;
+		}
+		long page_size = sysconf(_SC_PAGESIZE);
+		void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd,
+				  (off_t)opts.instance * page_size);
+		if (page == MAP_FAILED) {
+			perror("mmap");
+			return EXIT_FAILURE;
+		}
+		close(fd);
+		time_page = page;
+	}
+
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+		perror("sched_getaffinity");
+		return EXIT_FAILURE;
+	}
+	if ((unsigned int)CPU_COUNT(&cpus) < opts.max_threads) {
+		fprintf(stderr, "only %d CPUs are available\n", CPU_COUNT(&cpus));
+		return EXIT_FAILURE;
+	}
+
+	print_timebase();
+	printf("%-6s %7s %14s %10s %10s %10s\n", "# mode", "threads",
+	       "ops/sec", "p50_ns", "p99_ns", "p999_ns");
+	for (i = 1; i <= opts.max_threads; i++) {
+		run(i, &cpus);
+	}
+
+	return EXIT_SUCCESS;
+}
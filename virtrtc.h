@@ -0,0 +1,325 @@
+/* Definitions shared by the parts of the virtrtc module. */
+#ifndef VIRTRTC_H
+#define VIRTRTC_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/hrtimer.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/sched/clock.h>
+#include <linux/log2.h>
+
+#include "virtrtc_core.h"
+
+struct device;
+struct dentry;
+struct rtc_device;
+struct page;
+struct vm_area_struct;
+struct virt_rtc_guard;
+struct virt_rtc_timeline;
+struct attribute_group;
+
+extern enum virt_rtc_timebase timebase;
+
+/* Faults injected into the reads and the sets of an instance, see
+ * virtrtc_fault.c. Written under the lock of the fault settings, read
+ * without it. */
+struct virt_rtc_faults {
+	u64 latency_min;
+	u64 latency_max;
+	u32 eio_ppm;
+	u32 jump_ppm;
+	s64 jump_ns;
+	/* Whether the instance holds a reference to virt_rtc_faults. */
+	bool active;
+};
+
+/* Replay of a timeline and recording of the sets, see virtrtc_replay.c. */
+struct virt_rtc_replay {
+	/* Serializes everything but the readers of timeline, which use
+	 * RCU. */
+	struct mutex lock;
+	struct virt_rtc_timeline __rcu *timeline;
+	/* The timeline being written, and how many of its points are in. */
+	struct virt_rtc_timeline *loading;
+	u32 loaded;
+	/* Ring of the recorded sets, where the next one goes and how many
+	 * there are. */
+	struct virt_rtc_timeline *rec;
+	u32 rec_next;
+	u32 rec_len;
+	bool recording;
+};
+
+/* Per-instance state. Every instance lives in its own cache lines, so readers
+ * of one instance never contend with writers of another.
+ * Except for the jiffies time base, the anchor is never moved except by
+ * virt_rtc_set_time(), so it effectively stores just an offset and needs
+ * no timer.
+ * Writers change anchor under lock and then copy it into latched[] under
+ * the latch sequence counter. Readers only look at latched[]. */
+struct virt_rtc {
+	seqcount_t latch;
+	struct virt_rtc_anchor latched[2];
+
+	spinlock_t lock;
+	struct virt_rtc_anchor anchor;
+
+	/* Position in the guard's list and when the instance has to be
+	 * refreshed. */
+	struct virt_rtc_guard *guard;
+	struct list_head guard_node;
+	unsigned long guard_due;
+
+	/* Alarm in the virtual time. Protected by rtc->ops_lock. */
+	struct hrtimer alarm_timer;
+	ktime_t alarm_time;
+	bool alarm_enabled;
+
+	/* The time at suspend, and the reading of the clock that carries it
+	 * over the suspend. Written under lock. */
+	ktime_t suspend_time;
+	u64 suspend_clock;
+	bool suspend_counts;
+	/* Whether rtc is registered, and so whether there is anything to
+	 * suspend and resume. */
+	bool rtc_registered;
+
+	struct virt_rtc_faults faults;
+	struct virt_rtc_replay replay;
+
+	/* Copy of the state mapped by userspace. Written under lock. */
+	struct page *page;
+
+	unsigned int id;
+	/* Counts changes of the time other than by its running. */
+	atomic64_t changes;
+
+	/* The CPU the instance is used on, or -1. Its state is allocated on
+	 * the CPU's node. */
+	int cpu;
+	struct device *dev;
+	struct rtc_device *rtc;
+} ____cacheline_aligned_in_smp;
+
+/* Instance ids are below this. */
+#define VIRTRTC_MAX_INSTANCES 65536
+
+/* Protects the set of instances. */
+extern struct mutex virt_rtc_instances_lock;
+
+/* Returns the instance with the given id, or NULL.
+ * Must be called under virt_rtc_instances_lock. */
+struct virt_rtc *virt_rtc_get(unsigned int id);
+
+/* Returns the instance with the lowest id not below *id and stores the id
+ * there, or returns NULL. Must be called under virt_rtc_instances_lock. */
+struct virt_rtc *virt_rtc_next(unsigned int *id);
+
+/* Create and destroy instances. Take virt_rtc_instances_lock, but creation
+ * doesn't hold it while the devices are being registered. cpu is the hint
+ * for the placement of the instance, or -1. */
+int virt_rtc_add(unsigned int id, int cpu);
+int virt_rtc_del(unsigned int id);
+
+/* The current reading of the time base, and the time of the instance at
+ * such a reading. Taking one reading for many instances gives their times
+ * at the same instant. */
+u64 virt_rtc_timebase_now(void);
+ktime_t virt_rtc_read_at(struct virt_rtc *vrtc, u64 now);
+
+/* Sets the time of the instance to value nanoseconds, either since the epoch
+ * or, if offset, since CLOCK_REALTIME. Takes rtc->ops_lock. Leaves waking up
+ * the watchers of the control device to the caller. */
+void virt_rtc_step(struct virt_rtc *vrtc, s64 value, bool offset);
+
+/* Save and restore the time and the pace of the instance, see
+ * struct virtrtc_state_record. Restoring takes rtc->ops_lock, and leaves
+ * waking up the watchers of the control device to the caller. */
+void virt_rtc_save(struct virt_rtc *vrtc, struct virtrtc_state_record *rec);
+int virt_rtc_restore(struct virt_rtc *vrtc,
+		     const struct virtrtc_state_record *rec);
+
+/* virtrtc_page.c */
+int virt_rtc_page_alloc(struct virt_rtc *vrtc);
+void virt_rtc_page_free(struct virt_rtc *vrtc);
+void virt_rtc_page_publish(struct virt_rtc *vrtc);
+int virt_rtc_page_mmap(struct vm_area_struct *vma);
+
+/* virtrtc_ns.c
+ * Views of the instances from time namespaces, named by their inode
+ * numbers. 0 stands for the initial namespace, which sees the instances
+ * as they are. */
+#ifdef CONFIG_TIME_NS
+unsigned int virt_rtc_ns_current(void);
+s64 virt_rtc_ns_offset(unsigned int id, unsigned int inum);
+int virt_rtc_ns_set(unsigned int id, unsigned int inum, s64 offset);
+int virt_rtc_ns_del(unsigned int id, unsigned int inum);
+ssize_t virt_rtc_ns_show(unsigned int id, char *buf);
+void virt_rtc_ns_forget(unsigned int id);
+#else
+static inline unsigned int virt_rtc_ns_current(void)
+{
+	return 0;
+}
+
+static inline s64 virt_rtc_ns_offset(unsigned int id, unsigned int inum)
+{
+	return 0;
+}
+
+static inline int virt_rtc_ns_set(unsigned int id, unsigned int inum,
+				  s64 offset)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int virt_rtc_ns_del(unsigned int id, unsigned int inum)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline ssize_t virt_rtc_ns_show(unsigned int id, char *buf)
+{
+	return 0;
+}
+
+static inline void virt_rtc_ns_forget(unsigned int id)
+{
+}
+#endif
+
+/* virtrtc_fault.c */
+/* Enabled while any instance has faults set. */
+DECLARE_STATIC_KEY_FALSE(virt_rtc_faults);
+
+extern const struct attribute_group virt_rtc_fault_group;
+
+/* Delays the caller as set for the instance and returns -EIO or 0 as
+ * a failure is due. *jump is the step of the time that's due, or 0.
+ * May sleep. */
+int virt_rtc_fault(struct virt_rtc *vrtc, s64 *jump);
+/* Turns the faults of the instance off. */
+void virt_rtc_fault_clear(struct virt_rtc *vrtc);
+
+/* virtrtc_replay.c */
+/* Enabled while any instance replays a timeline. */
+DECLARE_STATIC_KEY_FALSE(virt_rtc_replaying);
+
+extern const struct attribute_group virt_rtc_replay_group;
+
+void virt_rtc_replay_init(struct virt_rtc *vrtc);
+/* Stops the replay and the recording and frees them. */
+void virt_rtc_replay_clear(struct virt_rtc *vrtc);
+/* Stores the replayed time at the time base reading now into *time, or
+ * returns false if the instance doesn't replay. */
+bool virt_rtc_replay_time(struct virt_rtc *vrtc, u64 now, ktime_t *time);
+/* Records a set of the time, if enabled. May sleep. */
+void virt_rtc_replay_record(struct virt_rtc *vrtc, ktime_t time);
+
+/* virtrtc_ctl.c */
+/* Counts a change of any instance for the readers of the control device.
+ * They are only woken up by virt_rtc_ctl_wake(), which a batch of changes
+ * calls once at the end. */
+void virt_rtc_ctl_changed(void);
+void virt_rtc_ctl_wake(void);
+int virt_rtc_ctl_init(void);
+void virt_rtc_ctl_exit(void);
+
+/* virtrtc_stats.c */
+
+/* Read latencies are accounted in buckets of [2^n, 2^(n+1)) nanoseconds. */
+#define VIRTRTC_LAT_BUCKETS 32
+
+/* Counters are per-CPU, so the hot paths never share cache lines.
+ * They are summed up only when read through debugfs. */
+struct virt_rtc_stats {
+	u64 reads;
+	u64 read_retries;
+	u64 tm_conversions;
+	u64 sets;
+	u64 timer_fires;
+	u64 guard_refreshes;
+	u64 write_holds;
+	u64 write_hold_ns;
+	u64 faults;
+	u64 read_lat[VIRTRTC_LAT_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct virt_rtc_stats, virt_rtc_stats);
+
+/* Measuring times costs a clock read, so it's off unless asked for. */
+DECLARE_STATIC_KEY_FALSE(virt_rtc_timing);
+
+#define virt_rtc_stat_inc(field) this_cpu_inc(virt_rtc_stats.field)
+#define virt_rtc_stat_add(field, val) this_cpu_add(virt_rtc_stats.field, val)
+
+/* Returns 0 if timing is disabled. */
+static inline u64 virt_rtc_timing_start(void)
+{
+	if (static_branch_unlikely(&virt_rtc_timing)) {
+		return local_clock();
+	}
+	return 0;
+}
+
+static inline void virt_rtc_stat_write_hold(u64 start)
+{
+	if (start) {
+		virt_rtc_stat_inc(write_holds);
+		virt_rtc_stat_add(write_hold_ns, local_clock() - start);
+	}
+}
+
+static inline void virt_rtc_stat_read_latency(u64 start)
+{
+	if (start) {
+		u64 ns = local_clock() - start;
+		unsigned int bucket = ns ? ilog2(ns) : 0;
+		virt_rtc_stat_inc(
+			read_lat[min(bucket, VIRTRTC_LAT_BUCKETS - 1U)]);
+	}
+}
+
+void virt_rtc_stats_init(void);
+void virt_rtc_stats_exit(void);
+
+/* virtrtc_flight.c */
+
+/* Enabled while the flight recorder runs, which it does unless turned off
+ * at load. */
+DECLARE_STATIC_KEY_FALSE(virt_rtc_flight);
+
+void virt_rtc_flight_log(u16 op, unsigned int id, u64 start,
+			 unsigned int retries);
+
+/* Returns the start of the operation to log, taken as start if timing is
+ * on, or 0 if the recorder is off. */
+static inline u64 virt_rtc_flight_start(u64 start)
+{
+	if (static_branch_likely(&virt_rtc_flight)) {
+		return start ? start : local_clock();
+	}
+	return 0;
+}
+
+static inline void virt_rtc_flight_record(u16 op, unsigned int id, u64 start,
+					  unsigned int retries)
+{
+	if (start) {
+		virt_rtc_flight_log(op, id, start, retries);
+	}
+}
+
+void virt_rtc_flight_init(struct dentry *dir);
+void virt_rtc_flight_exit(void);
+
+#endif /* VIRTRTC_H */
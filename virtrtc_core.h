@@ -0,0 +1,266 @@
+/* Time accounting of a virtual RTC.
+ * These are pure functions of the state and of the time base readings that
+ * are passed in. They never touch real clocks or locks, so the math can be
+ * driven with made-up jiffies, e.g. to check the wraparound, as
+ * virtrtc_kunit.c does. */
+#ifndef VIRTRTC_CORE_H
+#define VIRTRTC_CORE_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/errno.h>
+#include <linux/seqlock.h>
+
+#include "virtrtc_uapi.h"
+
+enum virt_rtc_timebase {
+	TIMEBASE_JIFFIES = VIRTRTC_TIMEBASE_JIFFIES,
+	TIMEBASE_MONO_FAST = VIRTRTC_TIMEBASE_MONO_FAST,
+	TIMEBASE_RAW = VIRTRTC_TIMEBASE_RAW,
+	TIMEBASE_REAL = VIRTRTC_TIMEBASE_REAL,
+	TIMEBASE_BOOT = VIRTRTC_TIMEBASE_BOOT,
+};
+
+/* The virtual time is last_time plus the time elapsed since last_base.
+ * last_base is in jiffies for the jiffies time base and in nanoseconds for
+ * the others.
+ * The elapsed time is scaled by rate_num / rate_den, and corrected by ppb
+ * parts per billion the way RTC offsets are: a positive ppb makes the time
+ * slower, a second lasting that many more billionths. To keep division off
+ * the read path, all of that is applied as a multiplication by mult and
+ * a shift.
+ * frac is the part of a nanosecond, in units of 2^-shift, that the scaling
+ * left over when the anchor was last advanced. Carrying it keeps frequent
+ * advances from losing time at rates that aren't a power of two. */
+struct virt_rtc_anchor {
+	ktime_t last_time;
+	u64 last_base;
+	u32 mult;
+	u32 shift;
+	u32 frac;
+	u32 rate_num;
+	u32 rate_den;
+	s32 ppb;
+};
+
+/* Bounds of the ppb correction, far beyond the error of any oscillator.
+ * Also keeps the correction factor between 1/2 and 2. */
+#define VIRTRTC_MAX_PPB 100000000
+
+/* Returns the time base units elapsed since last_base. */
+static inline u64 virt_rtc_base_delta(enum virt_rtc_timebase tb, u64 last_base,
+				      u64 now)
+{
+	if (tb == TIMEBASE_JIFFIES) {
+		/* Jiffies wrap around as unsigned long, not as u64. */
+		return (unsigned long)now - (unsigned long)last_base;
+	}
+	return now - last_base;
+}
+
+/* The length of a jiffy in nanoseconds of CLOCK_MONOTONIC. The tick code
+ * advances jiffies by whole ticks of NSEC_PER_SEC / HZ, truncated, so that's
+ * the length to count them by. jiffies64_to_nsecs() uses the exact 1/HZ
+ * instead, which drifts off CLOCK_MONOTONIC when HZ doesn't divide a second
+ * (by ~9 ms a day with HZ=300). */
+#define VIRTRTC_JIFFY_NSEC ((u64)(NSEC_PER_SEC / HZ))
+
+/* Converts the base units elapsed since last_base into nanoseconds. */
+static inline u64 virt_rtc_base_nsecs(enum virt_rtc_timebase tb, u64 delta)
+{
+	/* Not jiffies_to_nsecs(): it goes through 32-bit microseconds and
+	 * overflows after ~71 minutes, which a deferred timer may exceed. */
+	return tb == TIMEBASE_JIFFIES ? delta * VIRTRTC_JIFFY_NSEC : delta;
+}
+
+/* Scales elapsed nanoseconds by the rate, rounding down together with the
+ * remainder of the previous scaling. The new remainder goes into *frac. */
+static inline u64 virt_rtc_scale(const struct virt_rtc_anchor *a, u64 ns,
+				 u32 *frac)
+{
+	u64 mask = ((u64)1 << a->shift) - 1;
+	/* shift is at most 32, so the low bits of the 96-bit product are
+	 * those of the truncated one. */
+	u64 low = ((ns * a->mult) & mask) + a->frac;
+
+	*frac = low & mask;
+	return mul_u64_u32_shr(ns, a->mult, a->shift) + (low >> a->shift);
+}
+
+static inline ktime_t virt_rtc_extrapolate(enum virt_rtc_timebase tb,
+					   const struct virt_rtc_anchor *a,
+					   u64 now)
+{
+	u64 delta = virt_rtc_base_delta(tb, a->last_base, now);
+	u32 frac = 0;
+
+	return ktime_add_ns(a->last_time,
+			    virt_rtc_scale(a, virt_rtc_base_nsecs(tb, delta),
+					   &frac));
+}
+
+/* Like virt_rtc_extrapolate(), but now may also precede last_base, as when
+ * the anchor was moved after now had been read. */
+static inline ktime_t virt_rtc_time_at(enum virt_rtc_timebase tb,
+				       const struct virt_rtc_anchor *a, u64 now)
+{
+	u64 back = virt_rtc_base_delta(tb, now, a->last_base);
+	bool before = tb == TIMEBASE_JIFFIES ? (long)back > 0 : (s64)back > 0;
+
+	if (!before) {
+		return virt_rtc_extrapolate(tb, a, now);
+	}
+	return ktime_sub_ns(a->last_time,
+			    mul_u64_u32_shr(virt_rtc_base_nsecs(tb, back),
+					    a->mult, a->shift));
+}
+
+/* The second an RTC reads at the given time. Truncated, as hardware RTCs
+ * do: their second starts when it ticks over, and so do the seconds the
+ * update interrupts are aligned to. */
+static inline time64_t virt_rtc_secs(ktime_t time)
+{
+	return ktime_to_timespec64(time).tv_sec;
+}
+
+/* Converts a span of the virtual time into nanoseconds of the time base.
+ * Unlike virt_rtc_extrapolate(), it divides, so it's for the slow paths. */
+static inline s64 virt_rtc_unscale(const struct virt_rtc_anchor *a, s64 span)
+{
+	u64 ns = mul_u64_u32_div(span < 0 ? -span : span, a->rate_den,
+				 a->rate_num);
+
+	ns = mul_u64_u32_div(ns, NSEC_PER_SEC + a->ppb, NSEC_PER_SEC);
+	return span < 0 ? -(s64)ns : ns;
+}
+
+/* num / den corrected by ppb, in units of 2^-s. Anything above U32_MAX is
+ * only good for comparison. */
+static inline u64 virt_rtc_rate_mult(u32 num, u32 den, s32 ppb, u32 s)
+{
+	u64 m = div_u64((u64)num << s, den);
+
+	/* The correction at most doubles it, which mustn't overflow. */
+	if (m > 2ULL * U32_MAX) {
+		return m;
+	}
+	return mul_u64_u32_div(m, NSEC_PER_SEC, NSEC_PER_SEC + ppb);
+}
+
+/* Finds mult and shift for the rate num / den corrected by ppb. */
+static inline int virt_rtc_calc_rate(u32 num, u32 den, s32 ppb, u32 *mult,
+				     u32 *shift)
+{
+	u32 s = 32;
+
+	if (!num || !den) {
+		return -EINVAL;
+	}
+	if (ppb < -VIRTRTC_MAX_PPB || ppb > VIRTRTC_MAX_PPB) {
+		return -ERANGE;
+	}
+
+	/* The largest shift, and so the best precision, that keeps mult
+	 * in 32 bits. */
+	while (s > 0 && virt_rtc_rate_mult(num, den, ppb, s) > U32_MAX) {
+		s--;
+	}
+
+	/* Too fast even for a shift of 0, or too slow for any. */
+	u64 m = virt_rtc_rate_mult(num, den, ppb, s);
+	if (!m || m > U32_MAX) {
+		return -ERANGE;
+	}
+	*mult = m;
+	*shift = s;
+	return 0;
+}
+
+/* Moves the anchor to now without changing the time. */
+static inline void virt_rtc_advance(enum virt_rtc_timebase tb,
+				    struct virt_rtc_anchor *a, u64 now)
+{
+	u64 delta = virt_rtc_base_delta(tb, a->last_base, now);
+
+	a->last_time = ktime_add_ns(a->last_time,
+				    virt_rtc_scale(a,
+						   virt_rtc_base_nsecs(tb, delta),
+						   &a->frac));
+	a->last_base = now;
+}
+
+/* Changes the rate starting from now, without losing the time elapsed
+ * at the old rate. */
+static inline int virt_rtc_set_rate(enum virt_rtc_timebase tb,
+				    struct virt_rtc_anchor *a, u64 now, u32 num,
+				    u32 den, s32 ppb)
+{
+	u32 mult = 0;
+	u32 shift = 0;
+	int err = virt_rtc_calc_rate(num, den, ppb, &mult, &shift);
+	if (err < 0) {
+		return err;
+	}
+
+	virt_rtc_advance(tb, a, now);
+	a->mult = mult;
+	a->shift = shift;
+	/* Less than a nanosecond, and in the units of the old shift. */
+	a->frac = 0;
+	a->rate_num = num;
+	a->rate_den = den;
+	a->ppb = ppb;
+	return 0;
+}
+
+/* Makes the time equal to the given one at now. */
+static inline void virt_rtc_anchor_set(struct virt_rtc_anchor *a,
+				       ktime_t time, u64 now)
+{
+	a->last_time = time;
+	a->last_base = now;
+	a->frac = 0;
+}
+
+/* Copies the anchor into latched[] for the readers of the latch, which
+ * never wait for the writer: while one copy is being written, they read
+ * the other one. Writers have to be serialized. */
+static inline void virt_rtc_latch_write(seqcount_t *latch,
+					struct virt_rtc_anchor latched[2],
+					const struct virt_rtc_anchor *a)
+{
+	raw_write_seqcount_latch(latch);
+	latched[0] = *a;
+	raw_write_seqcount_latch(latch);
+	latched[1] = *a;
+}
+
+/* Takes a consistent copy of the latched anchor. Returns how many times it
+ * had to be retried. */
+static inline unsigned int
+virt_rtc_latch_read(seqcount_t *latch, const struct virt_rtc_anchor latched[2],
+		    struct virt_rtc_anchor *a)
+{
+	unsigned int retries = 0;
+	unsigned int seq = raw_read_seqcount_latch(latch);
+	for (;;) {
+		*a = latched[seq & 1];
+		if (!read_seqcount_retry(latch, seq)) {
+			break;
+		}
+		seq = raw_read_seqcount_latch(latch);
+		retries++;
+	}
+	return retries;
+}
+
+/* Whether an instance with the given guard deadline has to be refreshed
+ * by a timer expiry that refreshes everything due up to horizon. */
+static inline bool virt_rtc_guard_due(unsigned long due, unsigned long horizon)
+{
+	return !time_after(due, horizon);
+}
+
+#endif /* VIRTRTC_CORE_H */
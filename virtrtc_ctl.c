@@ -0,0 +1,547 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/compat.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+
+#include "virtrtc.h"
+
+/* The control device. Its node maps the time pages of the instances (see
+ * virtrtc_page.c), and its sysfs directory creates and destroys them:
+ *
+ *   echo 5 > /sys/class/misc/virtrtc/new_instance
+ *   echo 5 > /sys/class/misc/virtrtc/del_instance
+ *
+ * A CPU may follow the id of a new instance, to place the instance there:
+ *
+ *   echo "6 12" > /sys/class/misc/virtrtc/new_instance
+ *
+ * The attributes are kept off the instance devices, since a sysfs callback
+ * can't remove the device it is called for.
+ *
+ * The node also takes the batch ioctls described in virtrtc_uapi.h, and the
+ * state attribute saves and restores all the instances at once.
+ *
+ * Reading the node returns the generation of changes, a __u64 that grows
+ * whenever the time of any instance is changed other than by its running:
+ * set, stepped, steered or re-anchored on resume. A read blocks until the
+ * generation differs from the one the file saw last, so poll() and epoll
+ * tell when to re-read the instances. A new file has seen the current
+ * generation. */
+
+static atomic64_t changes = ATOMIC64_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(changes_wq);
+
+struct ctl_file {
+	u64 seen;
+};
+
+void virt_rtc_ctl_changed(void)
+{
+	atomic64_inc(&changes);
+}
+
+void virt_rtc_ctl_wake(void)
+{
+	wake_up_interruptible(&changes_wq);
+}
+
+static int virt_rtc_ctl_open(struct inode *inode __always_unused,
+			     struct file *file)
+{
+	struct ctl_file *cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+	if (!cf) {
+		return -ENOMEM;
+	}
+	cf->seen = atomic64_read(&changes);
+	file->private_data = cf;
+
+	return 0;
+}
+
+static int virt_rtc_ctl_release(struct inode *inode __always_unused,
+				struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t virt_rtc_ctl_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos __always_unused)
+{
+	struct ctl_file *cf = file->private_data;
+	u64 gen = 0;
+
+	if (count < sizeof(gen)) {
+		return -EINVAL;
+	}
+
+	for (;;) {
+		gen = atomic64_read(&changes);
+		if (gen != READ_ONCE(cf->seen)) {
+			break;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		int err = wait_event_interruptible(
+			changes_wq, atomic64_read(&changes) != cf->seen);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	if (copy_to_user(buf, &gen, sizeof(gen))) {
+		return -EFAULT;
+	}
+	WRITE_ONCE(cf->seen, gen);
+
+	return sizeof(gen);
+}
+
+static __poll_t virt_rtc_ctl_poll(struct file *file, poll_table *wait)
+{
+	struct ctl_file *cf = file->private_data;
+
+	poll_wait(file, &changes_wq, wait);
+
+	return atomic64_read(&changes) != READ_ONCE(cf->seen) ?
+		       EPOLLIN | EPOLLRDNORM :
+		       0;
+}
+
+static int virt_rtc_ctl_mmap(struct file *file __always_unused,
+			     struct vm_area_struct *vma)
+{
+	return virt_rtc_page_mmap(vma);
+}
+
+/* Entries are handled in chunks, each under virt_rtc_instances_lock. Nothing
+ * is copied from or to userspace under it, since faulting takes mmap_lock,
+ * which virt_rtc_page_mmap() holds while taking the instances lock. */
+#define BATCH_CHUNK 256
+
+static int check_entry(const struct virtrtc_entry *entry)
+{
+	return entry->flags & ~VIRTRTC_ENTRY_OFFSET ? -EINVAL : 0;
+}
+
+static int set_times(struct virtrtc_entry *entries, struct virtrtc_batch *batch)
+{
+	int err = 0;
+
+	if (!capable(CAP_SYS_TIME)) {
+		return -EPERM;
+	}
+
+	batch->done = 0;
+	while (!err && batch->done < batch->count) {
+		u32 end = min(batch->done + BATCH_CHUNK, batch->count);
+
+		/* Keeps the instances from going away in the middle. */
+		mutex_lock(&virt_rtc_instances_lock);
+		for (; batch->done < end; batch->done++) {
+			const struct virtrtc_entry *entry =
+				&entries[batch->done];
+
+			err = check_entry(entry);
+			if (err < 0) {
+				break;
+			}
+			struct virt_rtc *vrtc = virt_rtc_get(entry->id);
+			if (!vrtc) {
+				err = -ENXIO;
+				break;
+			}
+
+			virt_rtc_step(vrtc, entry->value,
+				      entry->flags & VIRTRTC_ENTRY_OFFSET);
+		}
+		mutex_unlock(&virt_rtc_instances_lock);
+
+		cond_resched();
+	}
+
+	/* Once for the whole batch. */
+	if (batch->done) {
+		virt_rtc_ctl_wake();
+	}
+	return err;
+}
+
+static int get_times(struct virtrtc_entry *entries, struct virtrtc_batch *batch)
+{
+	int err = 0;
+
+	/* Every instance is read at these, whichever chunk it's in. */
+	u64 now = virt_rtc_timebase_now();
+	ktime_t real = ktime_get_real();
+	batch->real = ktime_to_ns(real);
+
+	batch->done = 0;
+	while (!err && batch->done < batch->count) {
+		u32 end = min(batch->done + BATCH_CHUNK, batch->count);
+
+		mutex_lock(&virt_rtc_instances_lock);
+		for (; batch->done < end; batch->done++) {
+			struct virtrtc_entry *entry = &entries[batch->done];
+
+			err = check_entry(entry);
+			if (err < 0) {
+				break;
+			}
+			struct virt_rtc *vrtc = virt_rtc_get(entry->id);
+			if (!vrtc) {
+				err = -ENXIO;
+				break;
+			}
+
+			ktime_t time = virt_rtc_read_at(vrtc, now);
+			if (entry->flags & VIRTRTC_ENTRY_OFFSET) {
+				time = ktime_sub(time, real);
+			}
+			entry->value = ktime_to_ns(time);
+		}
+		mutex_unlock(&virt_rtc_instances_lock);
+
+		cond_resched();
+	}
+
+	return err;
+}
+
+static long virt_rtc_ctl_ioctl(struct file *file __always_unused,
+			       unsigned int cmd, unsigned long arg)
+{
+	struct virtrtc_batch __user *ubatch = (void __user *)arg;
+	struct virtrtc_batch batch;
+	int err = 0;
+
+	if (cmd != VIRTRTC_SET_TIMES && cmd != VIRTRTC_GET_TIMES) {
+		return -ENOTTY;
+	}
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch))) {
+		return -EFAULT;
+	}
+	if (batch.count > VIRTRTC_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	struct virtrtc_entry __user *uentries = u64_to_user_ptr(batch.entries);
+	size_t size = (size_t)batch.count * sizeof(struct virtrtc_entry);
+	struct virtrtc_entry *entries = vmemdup_user(uentries, size);
+	if (IS_ERR(entries)) {
+		return PTR_ERR(entries);
+	}
+
+	if (cmd == VIRTRTC_SET_TIMES) {
+		err = set_times(entries, &batch);
+	} else {
+		err = get_times(entries, &batch);
+		/* The values read before an error are reported too. */
+		if (copy_to_user(uentries, entries,
+				 batch.done * sizeof(struct virtrtc_entry))) {
+			err = -EFAULT;
+		}
+	}
+	kvfree(entries);
+
+	/* done is reported on errors too. */
+	if (copy_to_user(ubatch, &batch, sizeof(batch))) {
+		return -EFAULT;
+	}
+	return err;
+}
+
+static const struct file_operations virt_rtc_ctl_fops = {
+	.owner = THIS_MODULE,
+	.open = virt_rtc_ctl_open,
+	.release = virt_rtc_ctl_release,
+	.read = virt_rtc_ctl_read,
+	.poll = virt_rtc_ctl_poll,
+	.llseek = noop_llseek,
+	.mmap = virt_rtc_ctl_mmap,
+	.unlocked_ioctl = virt_rtc_ctl_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static ssize_t new_instance_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	char str[32];
+	unsigned int id = 0;
+	int cpu = -1;
+
+	if (count >= sizeof(str)) {
+		return -EINVAL;
+	}
+	memcpy(str, buf, count);
+	str[count] = '\0';
+
+	/* "id" or "id cpu". */
+	char *cpu_str = strim(str);
+	int err = kstrtouint(strsep(&cpu_str, " "), 0, &id);
+	if (!err && cpu_str) {
+		err = kstrtoint(skip_spaces(cpu_str), 0, &cpu);
+	}
+	if (err < 0) {
+		return err;
+	}
+
+	err = virt_rtc_add(id, cpu);
+	return err < 0 ? err : count;
+}
+static DEVICE_ATTR_WO(new_instance);
+
+static ssize_t del_instance_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	unsigned int id = 0;
+
+	int err = kstrtouint(buf, 0, &id);
+	if (err < 0) {
+		return err;
+	}
+
+	err = virt_rtc_del(id);
+	return err < 0 ? err : count;
+}
+static DEVICE_ATTR_WO(del_instance);
+
+/* The state blob is a sequence of slots: the header, then the record of
+ * every id. Writes may be split by sysfs into pages, so a slot never
+ * straddles two writes. */
+#define STATE_SLOT sizeof(struct virtrtc_state_record)
+
+static void fill_state_header(struct virtrtc_state_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = VIRTRTC_STATE_MAGIC;
+	hdr->version = VIRTRTC_STATE_VERSION;
+	hdr->record_size = STATE_SLOT;
+	hdr->real = ktime_get_real_ns();
+}
+
+/* Reserved fields must be zero, so they can be given a meaning later. */
+static bool state_header_valid(const struct virtrtc_state_header *hdr)
+{
+	return hdr->magic == VIRTRTC_STATE_MAGIC &&
+	       hdr->version == VIRTRTC_STATE_VERSION &&
+	       hdr->record_size == STATE_SLOT && !hdr->reserved &&
+	       !hdr->reserved2;
+}
+
+static bool state_record_valid(const struct virtrtc_state_record *rec)
+{
+	return !(rec->flags & ~VIRTRTC_STATE_PRESENT) && !rec->reserved;
+}
+
+/* The file whose write started with a valid header. Records are only taken
+ * from it, so a blob is never restored without its header being checked.
+ * It's held while it's here: once closed, its address could be reused by
+ * another open, which would pass for it. Protected by state_lock. */
+static DEFINE_MUTEX(state_lock);
+static struct file *state_writer;
+
+/* Must be called under state_lock. */
+static void set_state_writer(struct file *file)
+{
+	struct file *old = state_writer;
+
+	state_writer = file ? get_file(file) : NULL;
+	if (old) {
+		fput(old);
+	}
+}
+
+static ssize_t state_read(struct file *file, struct kobject *kobj,
+			  struct bin_attribute *attr, char *buf, loff_t off,
+			  size_t count)
+{
+	size_t done = 0;
+
+	BUILD_BUG_ON(sizeof(struct virtrtc_state_header) != STATE_SLOT);
+	if (off % STATE_SLOT) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&virt_rtc_instances_lock);
+
+	loff_t slot = off / STATE_SLOT;
+	for (; done + STATE_SLOT <= count; done += STATE_SLOT, slot++) {
+		if (slot == 0) {
+			fill_state_header((void *)(buf + done));
+			continue;
+		}
+		if (slot > VIRTRTC_MAX_INSTANCES) {
+			break;
+		}
+
+		unsigned int id = slot - 1;
+		unsigned int next = id;
+		struct virt_rtc *vrtc = virt_rtc_next(&next);
+		if (!vrtc) {
+			/* The end of the blob. */
+			break;
+		}
+
+		struct virtrtc_state_record *rec = (void *)(buf + done);
+		if (next == id) {
+			virt_rtc_save(vrtc, rec);
+		} else {
+			memset(rec, 0, sizeof(*rec));
+		}
+	}
+
+	mutex_unlock(&virt_rtc_instances_lock);
+	return done;
+}
+
+static int restore_instance(unsigned int id,
+			    const struct virtrtc_state_record *rec)
+{
+	if (id >= VIRTRTC_MAX_INSTANCES) {
+		return -EINVAL;
+	}
+
+	int err = virt_rtc_add(id, -1);
+	if (err < 0 && err != -EEXIST) {
+		return err;
+	}
+	bool created = !err;
+
+	mutex_lock(&virt_rtc_instances_lock);
+	struct virt_rtc *vrtc = virt_rtc_get(id);
+	/* Unless it's been deleted in the meantime. */
+	err = vrtc ? virt_rtc_restore(vrtc, rec) : -ENXIO;
+	mutex_unlock(&virt_rtc_instances_lock);
+
+	/* Doesn't leave behind an instance that doesn't match the blob. */
+	if (err < 0 && created) {
+		virt_rtc_del(id);
+	}
+	return err;
+}
+
+static ssize_t state_write(struct file *file, struct kobject *kobj,
+			   struct bin_attribute *attr, char *buf, loff_t off,
+			   size_t count)
+{
+	bool restored = false;
+	size_t done = 0;
+	int err = 0;
+
+	if (off % STATE_SLOT || count % STATE_SLOT) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&state_lock);
+
+	loff_t slot = off / STATE_SLOT;
+	for (; done < count; done += STATE_SLOT, slot++) {
+		if (slot == 0) {
+			struct virtrtc_state_header hdr;
+
+			memcpy(&hdr, buf + done, sizeof(hdr));
+			if (!state_header_valid(&hdr)) {
+				set_state_writer(NULL);
+				err = -EINVAL;
+				break;
+			}
+			set_state_writer(file);
+			continue;
+		}
+		if (state_writer != file) {
+			err = -EINVAL;
+			break;
+		}
+
+		struct virtrtc_state_record rec;
+		memcpy(&rec, buf + done, sizeof(rec));
+		if (!state_record_valid(&rec)) {
+			err = -EINVAL;
+			break;
+		}
+		if (!(rec.flags & VIRTRTC_STATE_PRESENT)) {
+			continue;
+		}
+
+		err = restore_instance(slot - 1, &rec);
+		if (err < 0) {
+			break;
+		}
+		restored = true;
+		cond_resched();
+	}
+
+	mutex_unlock(&state_lock);
+
+	/* Once for the whole write. */
+	if (restored) {
+		virt_rtc_ctl_wake();
+	}
+
+	/* Report the restored part, the rest fails on the next write. */
+	return done > 0 ? done : err;
+}
+static BIN_ATTR(state, 0600, state_read, state_write, 0);
+
+static struct attribute *virt_rtc_ctl_attrs[] = {
+	&dev_attr_new_instance.attr,
+	&dev_attr_del_instance.attr,
+	NULL,
+};
+
+static struct bin_attribute *virt_rtc_ctl_bin_attrs[] = {
+	&bin_attr_state,
+	NULL,
+};
+
+static const struct attribute_group virt_rtc_ctl_group = {
+	.attrs = virt_rtc_ctl_attrs,
+	.bin_attrs = virt_rtc_ctl_bin_attrs,
+};
+__ATTRIBUTE_GROUPS(virt_rtc_ctl);
+
+static struct miscdevice virt_rtc_ctl_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "virtrtc",
+	.fops = &virt_rtc_ctl_fops,
+	.mode = 0444,
+	.groups = virt_rtc_ctl_groups,
+};
+
+int virt_rtc_ctl_init(void)
+{
+	int err = misc_register(&virt_rtc_ctl_dev);
+	if (err < 0) {
+		pr_err("failed to register virtrtc misc device\n");
+	}
+	return err;
+}
+
+void virt_rtc_ctl_exit(void)
+{
+	misc_deregister(&virt_rtc_ctl_dev);
+
+	mutex_lock(&state_lock);
+	set_state_writer(NULL);
+	mutex_unlock(&state_lock);
+}
@@ -0,0 +1,227 @@
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/mutex.h>
+
+#include "virtrtc.h"
+
+/* Fault injection, to test the consumers against slow and flaky hardware.
+ * Every instance has a fault/ directory:
+ * - latency_ns :: "min max", every read and set is delayed by a uniformly
+ *   distributed time in between;
+ * - eio_ppm :: how many reads and sets in a million fail with -EIO;
+ * - jump_ppm, jump_ns :: how many reads and sets in a million step the time
+ *   by jump_ns first.
+ * All zeroes turn it off. While no instance has faults set, the hot paths
+ * only see a disabled static key. */
+
+DEFINE_STATIC_KEY_FALSE(virt_rtc_faults);
+
+/* Serializes the changes of the settings, so the key is counted right. */
+static DEFINE_MUTEX(faults_lock);
+
+#define PPM 1000000
+
+/* Must be called under faults_lock. */
+static void update_key(struct virt_rtc *vrtc)
+{
+	struct virt_rtc_faults *f = &vrtc->faults;
+	bool active = f->latency_max || f->eio_ppm || f->jump_ppm;
+
+	if (active == f->active) {
+		return;
+	}
+	if (active) {
+		static_branch_inc(&virt_rtc_faults);
+	} else {
+		static_branch_dec(&virt_rtc_faults);
+	}
+	f->active = active;
+}
+
+static bool chance(u32 ppm)
+{
+	return ppm && prandom_u32_max(PPM) < ppm;
+}
+
+static void delay_ns(u64 ns)
+{
+	/* Sleeping is too coarse for the short ones. */
+	if (ns < 10 * NSEC_PER_USEC) {
+		ndelay(ns);
+	} else {
+		u64 us = div_u64(ns, NSEC_PER_USEC);
+		usleep_range(us, us + us / 8);
+	}
+}
+
+int virt_rtc_fault(struct virt_rtc *vrtc, s64 *jump)
+{
+	struct virt_rtc_faults *f = &vrtc->faults;
+
+	u64 min = READ_ONCE(f->latency_min);
+	u64 max = READ_ONCE(f->latency_max);
+	if (max) {
+		u64 span = max - min;
+		/* The 32-bit randomness is stretched over longer spans. */
+		u64 ns = min + (span <= U32_MAX ?
+					prandom_u32_max(span + 1) :
+					mul_u64_u32_shr(span, prandom_u32(), 32));
+		delay_ns(ns);
+	}
+
+	*jump = chance(READ_ONCE(f->jump_ppm)) ? READ_ONCE(f->jump_ns) : 0;
+	if (*jump) {
+		virt_rtc_stat_inc(faults);
+	}
+
+	if (chance(READ_ONCE(f->eio_ppm))) {
+		virt_rtc_stat_inc(faults);
+		return -EIO;
+	}
+	return 0;
+}
+
+void virt_rtc_fault_clear(struct virt_rtc *vrtc)
+{
+	mutex_lock(&faults_lock);
+	memset(&vrtc->faults, 0, offsetof(struct virt_rtc_faults, active));
+	update_key(vrtc);
+	mutex_unlock(&faults_lock);
+}
+
+static ssize_t latency_ns_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu %llu\n", READ_ONCE(vrtc->faults.latency_min),
+		       READ_ONCE(vrtc->faults.latency_max));
+}
+
+static ssize_t latency_ns_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	unsigned long long min = 0;
+	unsigned long long max = 0;
+
+	/* A single value is a fixed latency. */
+	int n = sscanf(buf, "%llu %llu", &min, &max);
+	if (n < 1) {
+		return -EINVAL;
+	}
+	if (n == 1) {
+		max = min;
+	}
+	/* Callers hold the ops lock meanwhile, so keep it sane. */
+	if (min > max || max > NSEC_PER_SEC) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&faults_lock);
+	WRITE_ONCE(vrtc->faults.latency_min, min);
+	WRITE_ONCE(vrtc->faults.latency_max, max);
+	update_key(vrtc);
+	mutex_unlock(&faults_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(latency_ns);
+
+static ssize_t store_ppm(struct virt_rtc *vrtc, u32 *ppm, const char *buf,
+			 size_t count)
+{
+	u32 val = 0;
+
+	int err = kstrtou32(buf, 0, &val);
+	if (err < 0) {
+		return err;
+	}
+	if (val > PPM) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&faults_lock);
+	WRITE_ONCE(*ppm, val);
+	update_key(vrtc);
+	mutex_unlock(&faults_lock);
+
+	return count;
+}
+
+static ssize_t eio_ppm_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(vrtc->faults.eio_ppm));
+}
+
+static ssize_t eio_ppm_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return store_ppm(vrtc, &vrtc->faults.eio_ppm, buf, count);
+}
+static DEVICE_ATTR_RW(eio_ppm);
+
+static ssize_t jump_ppm_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(vrtc->faults.jump_ppm));
+}
+
+static ssize_t jump_ppm_store(struct device *dev,
+			      struct device_attribute *attr, const char *buf,
+			      size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return store_ppm(vrtc, &vrtc->faults.jump_ppm, buf, count);
+}
+static DEVICE_ATTR_RW(jump_ppm);
+
+static ssize_t jump_ns_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", READ_ONCE(vrtc->faults.jump_ns));
+}
+
+/* Doesn't enable anything by itself, jump_ppm does. */
+static ssize_t jump_ns_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	s64 val = 0;
+
+	int err = kstrtos64(buf, 0, &val);
+	if (err < 0) {
+		return err;
+	}
+	WRITE_ONCE(vrtc->faults.jump_ns, val);
+
+	return count;
+}
+static DEVICE_ATTR_RW(jump_ns);
+
+static struct attribute *virt_rtc_fault_attrs[] = {
+	&dev_attr_latency_ns.attr,
+	&dev_attr_eio_ppm.attr,
+	&dev_attr_jump_ppm.attr,
+	&dev_attr_jump_ns.attr,
+	NULL,
+};
+
+const struct attribute_group virt_rtc_fault_group = {
+	.name = "fault",
+	.attrs = virt_rtc_fault_attrs,
+};
@@ -0,0 +1,148 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+
+#include "virtrtc.h"
+
+/* Flight recorder: every read and set is logged into a ring of the CPU it
+ * runs on, which userspace maps and drains without copying, see struct
+ * virtrtc_flight_ring. Unlike the tracepoints, it's cheap enough to keep on,
+ * so the callers hammering the RTC can be found after the fact. The rings
+ * are only written by their CPUs, with the preemption disabled, so they need
+ * no locks. */
+
+static unsigned int flight_entries = 4096;
+module_param(flight_entries, uint, 0444);
+MODULE_PARM_DESC(flight_entries,
+		 "Entries of the per-CPU flight recorder rings, 0 turns it off (default: 4096)");
+
+/* Bounds the memory taken by the rings, 24 MiB per CPU. */
+#define FLIGHT_MAX_ENTRIES (1U << 20)
+
+DEFINE_STATIC_KEY_FALSE(virt_rtc_flight);
+
+/* The rings the loggers see, and the rings to free. They differ only while
+ * the recorder is being stopped. */
+static DEFINE_PER_CPU(struct virtrtc_flight_ring *, flight_rings);
+static DEFINE_PER_CPU(struct virtrtc_flight_ring *, flight_allocs);
+
+static size_t ring_bytes(unsigned int size)
+{
+	return PAGE_ALIGN(sizeof(struct virtrtc_flight_ring) +
+			  size * sizeof(struct virtrtc_flight_entry));
+}
+
+void virt_rtc_flight_log(u16 op, unsigned int id, u64 start,
+			 unsigned int retries)
+{
+	preempt_disable();
+
+	struct virtrtc_flight_ring *ring =
+		READ_ONCE(*this_cpu_ptr(&flight_rings));
+	if (ring) {
+		u64 head = ring->head;
+		struct virtrtc_flight_entry *e =
+			&ring->entries[head & (ring->size - 1)];
+
+		/* The entry is overwritten only after head says so. */
+		smp_wmb();
+		e->time = start;
+		e->latency = min_t(u64, local_clock() - start, U32_MAX);
+		e->pid = task_tgid_nr(current);
+		e->id = id;
+		e->op = op;
+		e->retries = min_t(unsigned int, retries, U16_MAX);
+		smp_wmb();
+		WRITE_ONCE(ring->head, head + 1);
+	}
+
+	preempt_enable();
+}
+
+static int flight_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct virtrtc_flight_ring *ring = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/* Checks that the mapping fits into the ring. */
+	return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+static const struct file_operations flight_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.mmap = flight_mmap,
+	.llseek = noop_llseek,
+};
+
+void virt_rtc_flight_init(struct dentry *dir)
+{
+	unsigned int cpu = 0;
+	bool any = false;
+
+	if (!flight_entries) {
+		return;
+	}
+	unsigned int size = roundup_pow_of_two(min(flight_entries,
+						   FLIGHT_MAX_ENTRIES));
+
+	/* Debugfs is optional, so its errors are ignored, and so are the
+	 * CPUs without a ring. */
+	struct dentry *flight_dir = debugfs_create_dir("flight", dir);
+	for_each_possible_cpu (cpu) {
+		/* Zeroed, and fit for remap_vmalloc_range(). */
+		struct virtrtc_flight_ring *ring =
+			vmalloc_user(ring_bytes(size));
+		if (!ring) {
+			pr_warn("no virtrtc flight recorder on cpu %u\n", cpu);
+			continue;
+		}
+		ring->size = size;
+		ring->entry_size = sizeof(struct virtrtc_flight_entry);
+		per_cpu(flight_allocs, cpu) = ring;
+		per_cpu(flight_rings, cpu) = ring;
+		any = true;
+
+		char name[16];
+		snprintf(name, sizeof(name), "cpu%u", cpu);
+		/* The full proxy of debugfs has no mmap. The file holds
+		 * the module, and so the rings, while it's open. */
+		debugfs_create_file_unsafe(name, 0400, flight_dir, ring,
+					   &flight_fops);
+	}
+
+	if (any) {
+		static_branch_enable(&virt_rtc_flight);
+	}
+}
+
+/* Must be called after the debugfs files are removed. */
+void virt_rtc_flight_exit(void)
+{
+	unsigned int cpu = 0;
+
+	static_branch_disable(&virt_rtc_flight);
+	/* Loggers that got past the key before it was disabled find no ring
+	 * after this. */
+	for_each_possible_cpu (cpu) {
+		WRITE_ONCE(per_cpu(flight_rings, cpu), NULL);
+	}
+	/* Waits for those that still use a ring, which run with the
+	 * preemption disabled. */
+	synchronize_rcu();
+
+	for_each_possible_cpu (cpu) {
+		/* Mappings hold their pages by themselves. */
+		vfree(per_cpu(flight_allocs, cpu));
+		per_cpu(flight_allocs, cpu) = NULL;
+	}
+}
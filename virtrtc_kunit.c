@@ -0,0 +1,427 @@
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/timex.h>
+
+#include "virtrtc_core.h"
+
+/* Tests of the time accounting of virtrtc_core.h, which is pure, so the time
+ * bases are made up here. Built as a module of its own, virtrtc_kunit, when
+ * the kernel has KUnit. */
+
+#define HOUR_NS (60ULL * 60 * NSEC_PER_SEC)
+
+static void init_anchor(struct kunit *test, struct virt_rtc_anchor *a,
+			u32 num, u32 den, s32 ppb)
+{
+	memset(a, 0, sizeof(*a));
+	KUNIT_ASSERT_EQ(test, 0, virt_rtc_calc_rate(num, den, ppb, &a->mult,
+						    &a->shift));
+	a->rate_num = num;
+	a->rate_den = den;
+	a->ppb = ppb;
+}
+
+static void base_delta_wraps_test(struct kunit *test)
+{
+	/* Jiffies wrap around as unsigned long, whatever the width of u64. */
+	u64 last = (unsigned long)-5;
+
+	KUNIT_EXPECT_EQ(test, (u64)15,
+			virt_rtc_base_delta(TIMEBASE_JIFFIES, last, 10));
+	KUNIT_EXPECT_EQ(test, (u64)3,
+			virt_rtc_base_delta(TIMEBASE_JIFFIES, last, last + 3));
+	KUNIT_EXPECT_EQ(test, (u64)7,
+			virt_rtc_base_delta(TIMEBASE_BOOT, 100, 107));
+}
+
+static void base_nsecs_long_gap_test(struct kunit *test)
+{
+	/* More than the ~71 minutes jiffies_to_nsecs() would overflow at. */
+	u64 jiffies_delta = 10ULL * 60 * 60 * HZ;
+
+	KUNIT_EXPECT_EQ(test, jiffies_delta * VIRTRTC_JIFFY_NSEC,
+			virt_rtc_base_nsecs(TIMEBASE_JIFFIES, jiffies_delta));
+	KUNIT_EXPECT_EQ(test, (u64)HOUR_NS,
+			virt_rtc_base_nsecs(TIMEBASE_RAW, HOUR_NS));
+}
+
+static void extrapolate_long_gap_test(struct kunit *test)
+{
+	struct virt_rtc_anchor a;
+
+	init_anchor(test, &a, 1, 1, 0);
+	a.last_time = 1000;
+	a.last_base = 5;
+	KUNIT_EXPECT_EQ(test, (ktime_t)(1000 + 10 * HOUR_NS),
+			virt_rtc_extrapolate(TIMEBASE_BOOT, &a,
+					     5 + 10 * HOUR_NS));
+
+	init_anchor(test, &a, 2, 1, 0);
+	KUNIT_EXPECT_EQ(test, (ktime_t)(12 * HOUR_NS),
+			virt_rtc_extrapolate(TIMEBASE_BOOT, &a, 6 * HOUR_NS));
+
+	/* A positive correction slows the time down. mult is truncated to
+	 * 32 bits, which may lose 2^-32 of the time, but not more. */
+	init_anchor(test, &a, 1, 1, 1000);
+	s64 want = mul_u64_u32_div(6 * HOUR_NS, NSEC_PER_SEC,
+				   NSEC_PER_SEC + 1000);
+	s64 got = virt_rtc_extrapolate(TIMEBASE_BOOT, &a, 6 * HOUR_NS);
+	KUNIT_EXPECT_LE(test, got, want);
+	KUNIT_EXPECT_LE(test, want - got, (s64)(6 * HOUR_NS >> 32) + 1);
+}
+
+static void time_at_goes_back_test(struct kunit *test)
+{
+	struct virt_rtc_anchor a;
+
+	init_anchor(test, &a, 1, 1, 0);
+	a.last_time = 10LL * NSEC_PER_SEC;
+	a.last_base = 100;
+	KUNIT_EXPECT_EQ(test, (ktime_t)(10LL * NSEC_PER_SEC - 40),
+			virt_rtc_time_at(TIMEBASE_BOOT, &a, 60));
+
+	a.last_base = (unsigned long)-2;
+	KUNIT_EXPECT_EQ(test,
+			(ktime_t)(10LL * NSEC_PER_SEC - 3 * VIRTRTC_JIFFY_NSEC),
+			virt_rtc_time_at(TIMEBASE_JIFFIES, &a,
+					 (unsigned long)-5));
+}
+
+/* Mimics the update interrupts of the rtc core: rtc_update_irq_enable()
+ * arms a timer for the second after the one read, and rtc_timer_do_work()
+ * expires every timer due by the second it reads, re-arming the periodic
+ * ones a second later. The alarm lands a little past the second, as
+ * hrtimers do, and still has to raise one event per second. */
+static void uie_cadence_test(struct kunit *test)
+{
+	static const s64 late[] = { 0, 1, 50 * NSEC_PER_USEC, NSEC_PER_SEC - 1 };
+	unsigned int i = 0;
+
+	KUNIT_EXPECT_EQ(test, (time64_t)5, virt_rtc_secs(5LL * NSEC_PER_SEC));
+	KUNIT_EXPECT_EQ(test, (time64_t)5, virt_rtc_secs(6LL * NSEC_PER_SEC - 1));
+	KUNIT_EXPECT_EQ(test, (time64_t)-1, virt_rtc_secs(-1));
+
+	for (i = 0; i < ARRAY_SIZE(late); i++) {
+		ktime_t enabled = 1000LL * NSEC_PER_SEC + late[i];
+		ktime_t next = (virt_rtc_secs(enabled) + 1) * NSEC_PER_SEC;
+		unsigned int s = 0;
+
+		for (s = 0; s < 10; s++) {
+			time64_t read = virt_rtc_secs(next + late[i]);
+			unsigned int events = 0;
+
+			while (next <= read * NSEC_PER_SEC) {
+				events++;
+				next += NSEC_PER_SEC;
+			}
+			KUNIT_EXPECT_EQ(test, 1U, events);
+		}
+	}
+}
+
+static void scale_carries_frac_test(struct kunit *test)
+{
+	struct virt_rtc_anchor step;
+	struct virt_rtc_anchor once;
+	unsigned int i = 0;
+
+	/* A third of a nanosecond per nanosecond is lost to every advance
+	 * unless the remainder is carried. */
+	init_anchor(test, &step, 1, 3, 0);
+	init_anchor(test, &once, 1, 3, 0);
+	for (i = 1; i <= 3000; i++) {
+		virt_rtc_advance(TIMEBASE_BOOT, &step, i);
+	}
+	virt_rtc_advance(TIMEBASE_BOOT, &once, 3000);
+
+	KUNIT_EXPECT_EQ(test, once.last_time, step.last_time);
+	KUNIT_EXPECT_GE(test, step.last_time, (ktime_t)999);
+}
+
+static void jiffies_advance_test(struct kunit *test)
+{
+	struct virt_rtc_anchor step;
+	struct virt_rtc_anchor once;
+	unsigned long now = (unsigned long)-HZ;
+	unsigned int i = 0;
+
+	/* Refreshes every second across the wraparound end up where
+	 * a single refresh does. */
+	init_anchor(test, &step, 7, 5, 0);
+	init_anchor(test, &once, 7, 5, 0);
+	step.last_base = now;
+	once.last_base = now;
+	for (i = 1; i <= 60; i++) {
+		virt_rtc_advance(TIMEBASE_JIFFIES, &step, now + i * HZ);
+	}
+	virt_rtc_advance(TIMEBASE_JIFFIES, &once, now + 60 * HZ);
+
+	KUNIT_EXPECT_EQ(test, once.last_time, step.last_time);
+	KUNIT_EXPECT_EQ(test, (u64)(unsigned long)(now + 60 * HZ),
+			step.last_base);
+}
+
+static void calc_rate_bounds_test(struct kunit *test)
+{
+	u32 mult = 0;
+	u32 shift = 0;
+
+	KUNIT_EXPECT_EQ(test, 0, virt_rtc_calc_rate(1, 1, VIRTRTC_MAX_PPB,
+						    &mult, &shift));
+	KUNIT_EXPECT_EQ(test, 0, virt_rtc_calc_rate(1, 1, -VIRTRTC_MAX_PPB,
+						    &mult, &shift));
+	KUNIT_EXPECT_EQ(test, -ERANGE,
+			virt_rtc_calc_rate(1, 1, VIRTRTC_MAX_PPB + 1, &mult,
+					   &shift));
+	KUNIT_EXPECT_EQ(test, -ERANGE,
+			virt_rtc_calc_rate(1, 1, -VIRTRTC_MAX_PPB - 1, &mult,
+					   &shift));
+	KUNIT_EXPECT_EQ(test, -EINVAL,
+			virt_rtc_calc_rate(0, 1, 0, &mult, &shift));
+	KUNIT_EXPECT_EQ(test, -EINVAL,
+			virt_rtc_calc_rate(1, 0, 0, &mult, &shift));
+	/* Too slow to be represented. */
+	KUNIT_EXPECT_EQ(test, -ERANGE,
+			virt_rtc_calc_rate(1, U32_MAX, VIRTRTC_MAX_PPB, &mult,
+					   &shift));
+
+	/* The largest rate still has the correction applied. */
+	KUNIT_EXPECT_EQ(test, 0, virt_rtc_calc_rate(U32_MAX, 1, VIRTRTC_MAX_PPB,
+						    &mult, &shift));
+	KUNIT_EXPECT_GT(test, mult, 0U);
+
+	/* A negative correction speeds the time up, past what 32 bits hold
+	 * for rates close enough to U32_MAX. */
+	KUNIT_EXPECT_EQ(test, -ERANGE,
+			virt_rtc_calc_rate(U32_MAX, 1, -1, &mult, &shift));
+	KUNIT_EXPECT_EQ(test, -ERANGE,
+			virt_rtc_calc_rate(4000000000U, 1, -VIRTRTC_MAX_PPB,
+					   &mult, &shift));
+	KUNIT_EXPECT_EQ(test, 0, virt_rtc_calc_rate(U32_MAX / 2, 1,
+						    -VIRTRTC_MAX_PPB, &mult,
+						    &shift));
+	KUNIT_EXPECT_EQ(test, 0U, shift);
+	KUNIT_EXPECT_EQ(test, (u32)mul_u64_u32_div(U32_MAX / 2, NSEC_PER_SEC,
+						   NSEC_PER_SEC -
+							   VIRTRTC_MAX_PPB),
+			mult);
+}
+
+static void set_rate_test(struct kunit *test)
+{
+	struct virt_rtc_anchor a;
+
+	init_anchor(test, &a, 1, 1, 0);
+	a.frac = 1;
+
+	/* The time elapsed at the old rate is kept. */
+	KUNIT_EXPECT_EQ(test, 0,
+			virt_rtc_set_rate(TIMEBASE_BOOT, &a, HOUR_NS, 2, 1, 0));
+	KUNIT_EXPECT_EQ(test, (ktime_t)HOUR_NS, a.last_time);
+	KUNIT_EXPECT_EQ(test, 0U, a.frac);
+	KUNIT_EXPECT_EQ(test, (ktime_t)(3 * HOUR_NS),
+			virt_rtc_extrapolate(TIMEBASE_BOOT, &a, 2 * HOUR_NS));
+
+	/* A rejected rate leaves the anchor alone. */
+	struct virt_rtc_anchor old = a;
+	KUNIT_EXPECT_EQ(test, -ERANGE,
+			virt_rtc_set_rate(TIMEBASE_BOOT, &a, 2 * HOUR_NS, 1, 1,
+					  VIRTRTC_MAX_PPB + 1));
+	KUNIT_EXPECT_EQ(test, 0, memcmp(&old, &a, sizeof(a)));
+
+	/* The correction goes back through virt_rtc_unscale(). */
+	KUNIT_EXPECT_EQ(test, 0,
+			virt_rtc_set_rate(TIMEBASE_BOOT, &a, a.last_base, 1, 1,
+					  VIRTRTC_MAX_PPB));
+	KUNIT_EXPECT_EQ(test, (s64)(HOUR_NS + HOUR_NS / 10),
+			virt_rtc_unscale(&a, HOUR_NS));
+}
+
+static void anchor_set_test(struct kunit *test)
+{
+	struct virt_rtc_anchor a;
+
+	init_anchor(test, &a, 1, 3, 0);
+	virt_rtc_advance(TIMEBASE_BOOT, &a, 1);
+	virt_rtc_anchor_set(&a, 42, 7);
+
+	KUNIT_EXPECT_EQ(test, (ktime_t)42, a.last_time);
+	KUNIT_EXPECT_EQ(test, (u64)7, a.last_base);
+	KUNIT_EXPECT_EQ(test, 0U, a.frac);
+}
+
+static void latch_half_written_test(struct kunit *test)
+{
+	struct virt_rtc_anchor latched[2];
+	struct virt_rtc_anchor a;
+	struct virt_rtc_anchor got;
+	seqcount_t latch;
+
+	seqcount_init(&latch);
+	memset(&a, 0, sizeof(a));
+	a.last_time = 1;
+	virt_rtc_latch_write(&latch, latched, &a);
+
+	/* A writer stopped in the middle of the first copy: readers take
+	 * the second one, which is still whole. */
+	raw_write_seqcount_latch(&latch);
+	memset(&latched[0], 0xff, sizeof(latched[0]));
+	KUNIT_EXPECT_EQ(test, 0U, virt_rtc_latch_read(&latch, latched, &got));
+	KUNIT_EXPECT_EQ(test, (ktime_t)1, got.last_time);
+
+	/* And the first one once the writer has moved on. */
+	a.last_time = 2;
+	latched[0] = a;
+	raw_write_seqcount_latch(&latch);
+	memset(&latched[1], 0xff, sizeof(latched[1]));
+	KUNIT_EXPECT_EQ(test, 0U, virt_rtc_latch_read(&latch, latched, &got));
+	KUNIT_EXPECT_EQ(test, (ktime_t)2, got.last_time);
+}
+
+struct latch_race {
+	seqcount_t latch;
+	struct virt_rtc_anchor latched[2];
+	/* What the writer starts from. */
+	struct virt_rtc_anchor init;
+};
+
+/* Keeps writing anchors whose fields all match. */
+static int latch_writer(void *data)
+{
+	struct latch_race *race = data;
+	struct virt_rtc_anchor a = race->init;
+	u64 i = 0;
+
+	while (!kthread_should_stop()) {
+		i++;
+		a.last_time = i;
+		a.last_base = i;
+		a.rate_num = i;
+		virt_rtc_latch_write(&race->latch, race->latched, &a);
+		if (!(i % 1024)) {
+			cond_resched();
+		}
+	}
+	return 0;
+}
+
+static struct latch_race *latch_race_alloc(struct kunit *test)
+{
+	struct latch_race *race = kunit_kzalloc(test, sizeof(*race),
+						GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, race);
+	seqcount_init(&race->latch);
+	return race;
+}
+
+static void latch_race_test(struct kunit *test)
+{
+	struct latch_race *race = latch_race_alloc(test);
+	unsigned long retries = 0;
+	unsigned long torn = 0;
+	unsigned int i = 0;
+
+	struct task_struct *writer = kthread_run(latch_writer, race,
+						 "virtrtc_kunit");
+	KUNIT_ASSERT_FALSE(test, IS_ERR(writer));
+
+	for (i = 0; i < 1000000; i++) {
+		struct virt_rtc_anchor got;
+
+		retries += virt_rtc_latch_read(&race->latch, race->latched,
+					       &got);
+		if (got.last_time != got.last_base ||
+		    got.rate_num != (u32)got.last_base) {
+			torn++;
+		}
+		if (!(i % 1024)) {
+			cond_resched();
+		}
+	}
+	kthread_stop(writer);
+
+	KUNIT_EXPECT_EQ(test, 0UL, torn);
+	kunit_info(test, "%lu retries in %u reads\n", retries, i);
+}
+
+#define BENCH_READS (1024 * 1024)
+
+/* Times what virt_rtc_read_time() does with the anchor: a snapshot from the
+ * latch and the extrapolation. Rescheduling between the batches isn't
+ * counted. */
+static void time_reads(struct kunit *test, struct latch_race *race,
+		       const char *what)
+{
+	cycles_t cycles = 0;
+	unsigned long retries = 0;
+	ktime_t sum = 0;
+	unsigned int i = 0;
+	unsigned int j = 0;
+
+	for (i = 0; i < BENCH_READS; i += 1024) {
+		cycles_t start = get_cycles();
+		for (j = 0; j < 1024; j++) {
+			struct virt_rtc_anchor got;
+
+			retries += virt_rtc_latch_read(&race->latch,
+						       race->latched, &got);
+			sum += virt_rtc_extrapolate(TIMEBASE_BOOT, &got,
+						    got.last_base + i + j);
+		}
+		cycles += get_cycles() - start;
+		cond_resched();
+	}
+
+	/* get_cycles() may not be implemented and return 0. */
+	kunit_info(test,
+		   "%s: %llu cycles per read, %lu retries in %u reads (sum %lld)\n",
+		   what, div_u64(cycles, BENCH_READS), retries, BENCH_READS,
+		   sum);
+}
+
+/* Not a test as such: logs what the read path costs, alone and against
+ * a writer that keeps the latch busy. */
+static void read_cycles_test(struct kunit *test)
+{
+	struct latch_race *race = latch_race_alloc(test);
+
+	init_anchor(test, &race->init, 7, 5, 1234);
+	virt_rtc_latch_write(&race->latch, race->latched, &race->init);
+	time_reads(test, race, "no writer");
+
+	struct task_struct *writer = kthread_run(latch_writer, race,
+						 "virtrtc_kunit");
+	KUNIT_ASSERT_FALSE(test, IS_ERR(writer));
+	time_reads(test, race, "writer");
+	kthread_stop(writer);
+}
+
+static struct kunit_case virt_rtc_core_cases[] = {
+	KUNIT_CASE(base_delta_wraps_test),
+	KUNIT_CASE(base_nsecs_long_gap_test),
+	KUNIT_CASE(extrapolate_long_gap_test),
+	KUNIT_CASE(time_at_goes_back_test),
+	KUNIT_CASE(uie_cadence_test),
+	KUNIT_CASE(scale_carries_frac_test),
+	KUNIT_CASE(jiffies_advance_test),
+	KUNIT_CASE(calc_rate_bounds_test),
+	KUNIT_CASE(set_rate_test),
+	KUNIT_CASE(anchor_set_test),
+	KUNIT_CASE(latch_half_written_test),
+	KUNIT_CASE(latch_race_test),
+	KUNIT_CASE(read_cycles_test),
+	{}
+};
+
+static struct kunit_suite virt_rtc_core_suite = {
+	.name = "virtrtc_core",
+	.test_cases = virt_rtc_core_cases,
+};
+kunit_test_suite(virt_rtc_core_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Tests of the virtrtc time accounting");
@@ -0,0 +1,1323 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/seqlock.h>
+#include <linux/rtc.h>
+#include <linux/device.h>
+#include <linux/platform_device.h>
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/timekeeping.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/sysfs.h>
+#include <linux/xarray.h>
+#include <linux/pm.h>
+#include <linux/async.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/compiler_attributes.h>
+
+#include "virtrtc.h"
+
+#define CREATE_TRACE_POINTS
+#include "virtrtc_trace.h"
+
+static const char *const timebase_names[] = {
+	[TIMEBASE_JIFFIES] = "jiffies",
+	[TIMEBASE_MONO_FAST] = "mono_fast",
+	[TIMEBASE_RAW] = "raw",
+	[TIMEBASE_REAL] = "real",
+	[TIMEBASE_BOOT] = "boot",
+};
+
+static char *timebase_param = "jiffies";
+module_param_named(timebase, timebase_param, charp, 0444);
+MODULE_PARM_DESC(timebase,
+		 "Source of the time: jiffies, boot, real, mono_fast or raw (default: jiffies)");
+
+enum virt_rtc_timebase timebase = TIMEBASE_JIFFIES;
+
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances,
+		 "Number of virtual RTC devices to create at load (default: 1)");
+
+static int count_suspend = -1;
+module_param(count_suspend, int, 0644);
+MODULE_PARM_DESC(count_suspend,
+		 "Whether the virtual time runs while the system is suspended: 1 runs, 0 stops, -1 does what the time base does (default: -1)");
+
+static struct kmem_cache *vrtc_cache;
+/* Instances by their ids, changed under virt_rtc_instances_lock.
+ * An instance being created holds a reserved entry, which lookups treat as
+ * empty. The creation itself runs without the lock, so instances may be
+ * created in parallel. Destruction runs under it. */
+static DEFINE_XARRAY(vrtcs);
+DEFINE_MUTEX(virt_rtc_instances_lock);
+
+static bool async_register;
+module_param(async_register, bool, 0444);
+MODULE_PARM_DESC(async_register,
+		 "Create the instances in the background, in parallel, at load (default: N)");
+
+static ASYNC_DOMAIN_EXCLUSIVE(virt_rtc_async);
+
+/* Upper bound for the guard interval. Keeps the jiffies delta far from
+ * wrapping an unsigned long even on 32-bit machines with a high HZ. */
+#define VIRTRTC_GUARD_MAX_SECS (24 * 60 * 60)
+
+static unsigned int guard_interval = 60 * 60;
+module_param(guard_interval, uint, 0444);
+MODULE_PARM_DESC(guard_interval,
+		 "Seconds between forced updates of the time in the jiffies time base (default: 3600)");
+
+static unsigned long guard_jiffies;
+
+/* Readers don't update the state, so do it periodically by ourselves,
+ * so we won't lose the time because of jiffies overflow.
+ * Every CPU has a guard: a timer pinned to the CPU and the instances it
+ * refreshes, so their state is written where it's read. An instance goes to
+ * the guard of its CPU hint, or else of the CPU that created it.
+ * A guard's instances are queued in the order of their guard_due: all of
+ * them use the same interval, so a refreshed instance simply goes to the
+ * tail. On expiry, the timer pops only those that are due and is re-armed
+ * for the new head.
+ * The timer is deferrable, so it never wakes an idle CPU up. Firing late
+ * is fine as long as it happens before the jiffies delta wraps around. */
+struct virt_rtc_guard {
+	struct timer_list timer;
+	struct list_head list;
+	spinlock_t lock;
+	unsigned int cpu;
+};
+
+static DEFINE_PER_CPU(struct virt_rtc_guard, guards);
+
+/* Instances due within this window are refreshed together with the due ones,
+ * so the instances created at about the same time share expiries. */
+static unsigned long guard_batch_jiffies(void)
+{
+	return guard_jiffies / 16;
+}
+
+static u64 timebase_now(void)
+{
+	switch (timebase) {
+	case TIMEBASE_MONO_FAST:
+		return ktime_get_mono_fast_ns();
+	case TIMEBASE_RAW:
+		return ktime_get_raw_ns();
+	case TIMEBASE_REAL:
+		return ktime_get_real_ns();
+	case TIMEBASE_BOOT:
+		return ktime_get_boottime_ns();
+	case TIMEBASE_JIFFIES:
+	default:
+		return jiffies;
+	}
+}
+
+/* Makes the changes of vrtc->anchor visible to the readers.
+ * Readers of the latch never wait for the writer: while one copy is being
+ * written, they read the other one. That's also why taking the lock doesn't
+ * need to disable interrupts: no reader spins on it. */
+static void latch_anchor(struct virt_rtc *vrtc)
+{
+	virt_rtc_latch_write(&vrtc->latch, vrtc->latched, &vrtc->anchor);
+}
+
+static void update_time(struct virt_rtc *vrtc)
+{
+	spin_lock_bh(&vrtc->lock);
+	u64 start = virt_rtc_timing_start();
+
+	u64 now = timebase_now();
+	u64 delta = virt_rtc_base_delta(timebase, vrtc->anchor.last_base, now);
+	virt_rtc_advance(timebase, &vrtc->anchor, now);
+	latch_anchor(vrtc);
+	virt_rtc_page_publish(vrtc);
+	ktime_t time = vrtc->anchor.last_time;
+
+	virt_rtc_stat_write_hold(start);
+	spin_unlock_bh(&vrtc->lock);
+
+	trace_virtrtc_update_time(vrtc->id, delta, time);
+}
+
+static void virt_rtc_periodic_update(struct timer_list *t)
+{
+	struct virt_rtc_guard *guard = from_timer(guard, t, timer);
+	unsigned long now = jiffies;
+	unsigned long horizon = now + guard_batch_jiffies();
+	unsigned int refreshed = 0;
+	unsigned long next_due = 0;
+
+	virt_rtc_stat_inc(timer_fires);
+
+	spin_lock(&guard->lock);
+
+	while (!list_empty(&guard->list)) {
+		struct virt_rtc *vrtc = list_first_entry(
+			&guard->list, struct virt_rtc, guard_node);
+		if (!virt_rtc_guard_due(vrtc->guard_due, horizon)) {
+			break;
+		}
+
+		update_time(vrtc);
+		refreshed++;
+		vrtc->guard_due = now + guard_jiffies;
+		list_move_tail(&vrtc->guard_node, &guard->list);
+	}
+
+	if (!list_empty(&guard->list)) {
+		struct virt_rtc *head = list_first_entry(
+			&guard->list, struct virt_rtc, guard_node);
+		next_due = head->guard_due;
+		/* The timer is pinned, so it stays on this CPU. */
+		mod_timer(&guard->timer, next_due);
+	}
+
+	spin_unlock(&guard->lock);
+
+	virt_rtc_stat_add(guard_refreshes, refreshed);
+	trace_virtrtc_timer_expire(refreshed, next_due);
+}
+
+static void guard_add(struct virt_rtc *vrtc)
+{
+	unsigned int cpu = vrtc->cpu >= 0 ? vrtc->cpu : raw_smp_processor_id();
+	struct virt_rtc_guard *guard = per_cpu_ptr(&guards, cpu);
+
+	vrtc->guard = guard;
+
+	spin_lock_bh(&guard->lock);
+
+	/* The state was anchored just now, so it goes to the tail. */
+	vrtc->guard_due = jiffies + guard_jiffies;
+	/* A pending timer fires before the new instance is due, and then
+	 * re-arms itself for the head. */
+	if (list_empty(&guard->list) && !timer_pending(&guard->timer)) {
+		guard->timer.expires = vrtc->guard_due;
+		/* Timers of an offline CPU don't run until it's back. */
+		add_timer_on(&guard->timer, cpu_online(guard->cpu) ?
+						    guard->cpu :
+						    raw_smp_processor_id());
+	}
+	list_add_tail(&vrtc->guard_node, &guard->list);
+
+	spin_unlock_bh(&guard->lock);
+}
+
+static void guard_del(struct virt_rtc *vrtc)
+{
+	struct virt_rtc_guard *guard = vrtc->guard;
+
+	/* If the instance was the head, the timer fires for nothing once. */
+	spin_lock_bh(&guard->lock);
+	list_del(&vrtc->guard_node);
+	spin_unlock_bh(&guard->lock);
+}
+
+static void guards_init(void)
+{
+	unsigned int cpu = 0;
+
+	for_each_possible_cpu (cpu) {
+		struct virt_rtc_guard *guard = per_cpu_ptr(&guards, cpu);
+
+		timer_setup(&guard->timer, virt_rtc_periodic_update,
+			    TIMER_DEFERRABLE | TIMER_PINNED);
+		INIT_LIST_HEAD(&guard->list);
+		spin_lock_init(&guard->lock);
+		guard->cpu = cpu;
+	}
+}
+
+static void guards_exit(void)
+{
+	unsigned int cpu = 0;
+
+	for_each_possible_cpu (cpu) {
+		del_timer_sync(&per_cpu_ptr(&guards, cpu)->timer);
+	}
+}
+
+/* Returns how many times the snapshot had to be retried. */
+static unsigned int read_anchor(struct virt_rtc *vrtc,
+				struct virt_rtc_anchor *anchor)
+{
+	return virt_rtc_latch_read(&vrtc->latch, vrtc->latched, anchor);
+}
+
+static ktime_t virt_rtc_now(struct virt_rtc *vrtc)
+{
+	struct virt_rtc_anchor anchor;
+
+	/* Readers never write the state: the time is extrapolated from
+	 * the snapshot, while keeping it fresh is the timer's job. */
+	read_anchor(vrtc, &anchor);
+
+	return virt_rtc_extrapolate(timebase, &anchor, timebase_now());
+}
+
+static unsigned int alarm_slack_ns = 50 * NSEC_PER_USEC;
+module_param(alarm_slack_ns, uint, 0644);
+MODULE_PARM_DESC(alarm_slack_ns,
+		 "Allowed lateness of alarms in nanoseconds (default: 50000)");
+
+static unsigned int max_user_freq = 64;
+module_param(max_user_freq, uint, 0444);
+MODULE_PARM_DESC(max_user_freq,
+		 "Highest periodic interrupt rate allowed to unprivileged users (default: 64)");
+
+/* The clock of the alarm timers. The mono_fast, real and boot time bases
+ * are CLOCK_MONOTONIC, CLOCK_REALTIME and CLOCK_BOOTTIME themselves, so the
+ * alarm is converted into an absolute expiry that lands exactly on the
+ * virtual time in question. That's what keeps update interrupts aligned to
+ * the virtual seconds. */
+static clockid_t alarm_clockid(void)
+{
+	switch (timebase) {
+	case TIMEBASE_REAL:
+		return CLOCK_REALTIME;
+	case TIMEBASE_BOOT:
+		return CLOCK_BOOTTIME;
+	default:
+		return CLOCK_MONOTONIC;
+	}
+}
+
+static ktime_t alarm_expiry(struct virt_rtc *vrtc)
+{
+	struct virt_rtc_anchor anchor;
+	read_anchor(vrtc, &anchor);
+
+	switch (timebase) {
+	case TIMEBASE_MONO_FAST:
+	case TIMEBASE_REAL:
+	case TIMEBASE_BOOT:
+		return ktime_add_ns(
+			ns_to_ktime(anchor.last_base),
+			virt_rtc_unscale(&anchor, ktime_sub(vrtc->alarm_time,
+							    anchor.last_time)));
+	case TIMEBASE_JIFFIES:
+	case TIMEBASE_RAW:
+	default:
+		break;
+	}
+
+	/* Otherwise, the time base and CLOCK_MONOTONIC are assumed to advance
+	 * at the same pace. */
+	ktime_t now = virt_rtc_extrapolate(timebase, &anchor, timebase_now());
+	s64 delta = virt_rtc_unscale(&anchor, ktime_sub(vrtc->alarm_time, now));
+	/* Jiffies only move on ticks, so an alarm still ahead is reached a tick
+	 * later at the soonest. Any earlier, the timer would just fire again
+	 * and again until then. */
+	if (timebase == TIMEBASE_JIFFIES && delta > 0) {
+		delta = max_t(s64, delta, VIRTRTC_JIFFY_NSEC);
+	}
+	return ktime_add_ns(ktime_get(), delta);
+}
+
+static void alarm_arm(struct virt_rtc *vrtc)
+{
+	hrtimer_start_range_ns(&vrtc->alarm_timer, alarm_expiry(vrtc),
+			       READ_ONCE(alarm_slack_ns), HRTIMER_MODE_ABS);
+}
+
+/* The time has jumped or changed its pace, so the alarm has to be
+ * rescheduled. Must be called under rtc->ops_lock. */
+static void alarm_rearm(struct virt_rtc *vrtc)
+{
+	if (vrtc->alarm_enabled) {
+		hrtimer_cancel(&vrtc->alarm_timer);
+		alarm_arm(vrtc);
+	}
+}
+
+static enum hrtimer_restart virt_rtc_alarm_fire(struct hrtimer *t)
+{
+	struct virt_rtc *vrtc = container_of(t, struct virt_rtc, alarm_timer);
+
+	/* The virtual time may still run behind the timer's clock: it's
+	 * quantized by jiffies, or its time base drifts against
+	 * CLOCK_MONOTONIC. */
+	if (ktime_before(virt_rtc_now(vrtc), vrtc->alarm_time)) {
+		hrtimer_set_expires_range_ns(t, alarm_expiry(vrtc),
+					     READ_ONCE(alarm_slack_ns));
+		return HRTIMER_RESTART;
+	}
+
+	/* Update interrupts are alarms set by the rtc core a second apart,
+	 * so a single call wakes up all the readers of the device. */
+	rtc_update_irq(vrtc->rtc, 1, RTC_AF | RTC_IRQF);
+	return HRTIMER_NORESTART;
+}
+
+/* Most readers ask for the time many times a second, so every CPU caches
+ * the last converted second of a few instances. The conversion depends on
+ * the second alone, so an entry is valid for whichever instance reads that
+ * second. The instances are spread over the slots by their ids only so they
+ * don't evict each other. */
+#define TM_CACHE_SLOTS 8
+
+struct tm_cache_slot {
+	bool valid;
+	time64_t secs;
+	struct rtc_time tm;
+};
+
+static DEFINE_PER_CPU(struct tm_cache_slot[TM_CACHE_SLOTS], tm_cache);
+
+static void time_to_tm(const struct virt_rtc *vrtc, ktime_t time,
+		       struct rtc_time *tm)
+{
+	time64_t secs = virt_rtc_secs(time);
+
+	struct tm_cache_slot *slots = *get_cpu_ptr(&tm_cache);
+	struct tm_cache_slot *slot = &slots[vrtc->id % TM_CACHE_SLOTS];
+	if (!slot->valid || slot->secs != secs) {
+		rtc_time64_to_tm(secs, &slot->tm);
+		slot->valid = true;
+		slot->secs = secs;
+		virt_rtc_stat_inc(tm_conversions);
+	}
+	*tm = slot->tm;
+	put_cpu_ptr(&tm_cache);
+}
+
+static void step_time(struct virt_rtc *vrtc, ktime_t time);
+
+/* Injects the faults set for the instance, see virtrtc_fault.c. Costs only
+ * a patched-out branch while no instance has any.
+ * Must be called under rtc->ops_lock. */
+static int inject_faults(struct virt_rtc *vrtc)
+{
+	s64 jump = 0;
+
+	if (!static_branch_unlikely(&virt_rtc_faults)) {
+		return 0;
+	}
+
+	int err = virt_rtc_fault(vrtc, &jump);
+	if (jump) {
+		step_time(vrtc, ktime_add_ns(virt_rtc_now(vrtc), jump));
+		virt_rtc_ctl_wake();
+	}
+	return err;
+}
+
+static int virt_rtc_read_time(struct device *dev, struct rtc_time *tm)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	struct virt_rtc_anchor anchor;
+
+	int err = inject_faults(vrtc);
+	if (err < 0) {
+		return err;
+	}
+
+	u64 start = virt_rtc_timing_start();
+	u64 flight = virt_rtc_flight_start(start);
+	unsigned int retries = read_anchor(vrtc, &anchor);
+	u64 base = timebase_now();
+	ktime_t now = virt_rtc_extrapolate(timebase, &anchor, base);
+	if (static_branch_unlikely(&virt_rtc_replaying)) {
+		virt_rtc_replay_time(vrtc, base, &now);
+	}
+	now = ktime_add_ns(now, virt_rtc_ns_offset(vrtc->id,
+						   virt_rtc_ns_current()));
+	time_to_tm(vrtc, now, tm);
+
+	virt_rtc_stat_inc(reads);
+	virt_rtc_stat_add(read_retries, retries);
+	virt_rtc_stat_read_latency(start);
+	trace_virtrtc_read_time(vrtc->id, now, retries);
+	virt_rtc_flight_record(VIRTRTC_FLIGHT_READ, vrtc->id, flight, retries);
+
+	return rtc_valid_tm(tm);
+}
+
+/* Counts a change of the time other than by its running, and wakes up the
+ * watchers of the instance's changes attribute. Those of the control device
+ * are left to virt_rtc_ctl_wake(), so a batch of changes wakes them once:
+ * there may be thousands of them. */
+static void count_change(struct virt_rtc *vrtc)
+{
+	atomic64_inc(&vrtc->changes);
+	sysfs_notify(&vrtc->dev->kobj, NULL, "changes");
+	virt_rtc_ctl_changed();
+}
+
+/* Counts a change and wakes up all of its watchers. */
+static void notify_change(struct virt_rtc *vrtc)
+{
+	count_change(vrtc);
+	virt_rtc_ctl_wake();
+}
+
+/* Makes the time of the instance equal to the given one. The watchers of
+ * the control device are left to the caller.
+ * Must be called under rtc->ops_lock. */
+static void step_time(struct virt_rtc *vrtc, ktime_t time)
+{
+	spin_lock_bh(&vrtc->lock);
+	u64 start = virt_rtc_timing_start();
+
+	u64 now = timebase_now();
+	ktime_t old_time = virt_rtc_extrapolate(timebase, &vrtc->anchor, now);
+	virt_rtc_anchor_set(&vrtc->anchor, time, now);
+	latch_anchor(vrtc);
+	virt_rtc_page_publish(vrtc);
+
+	virt_rtc_stat_write_hold(start);
+	spin_unlock_bh(&vrtc->lock);
+
+	virt_rtc_stat_inc(sets);
+	trace_virtrtc_set_time(vrtc->id, old_time, time);
+	virt_rtc_replay_record(vrtc, time);
+
+	alarm_rearm(vrtc);
+	count_change(vrtc);
+}
+
+static int virt_rtc_set_time(struct device *dev, struct rtc_time *tm)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	int err = inject_faults(vrtc);
+	if (err < 0) {
+		return err;
+	}
+
+	u64 flight = virt_rtc_flight_start(0);
+
+	/* Time namespaces other than the initial one only change their view,
+	 * never the time of the others. */
+	unsigned int inum = virt_rtc_ns_current();
+	if (inum) {
+		ktime_t offset = ktime_sub(rtc_tm_to_ktime(*tm),
+					   virt_rtc_now(vrtc));
+		err = virt_rtc_ns_set(vrtc->id, inum, ktime_to_ns(offset));
+		if (!err) {
+			count_change(vrtc);
+		}
+	} else {
+		step_time(vrtc, rtc_tm_to_ktime(*tm));
+	}
+	if (!err) {
+		virt_rtc_ctl_wake();
+	}
+
+	virt_rtc_flight_record(VIRTRTC_FLIGHT_SET, vrtc->id, flight, 0);
+	return err;
+}
+
+u64 virt_rtc_timebase_now(void)
+{
+	return timebase_now();
+}
+
+ktime_t virt_rtc_read_at(struct virt_rtc *vrtc, u64 now)
+{
+	struct virt_rtc_anchor anchor;
+
+	read_anchor(vrtc, &anchor);
+
+	return virt_rtc_time_at(timebase, &anchor, now);
+}
+
+void virt_rtc_step(struct virt_rtc *vrtc, s64 value, bool offset)
+{
+	mutex_lock(&vrtc->rtc->ops_lock);
+	/* Sampled under the lock, so the wait doesn't skew the offset. */
+	step_time(vrtc, offset ? ktime_add_ns(ktime_get_real(), value) :
+				 ns_to_ktime(value));
+	mutex_unlock(&vrtc->rtc->ops_lock);
+}
+
+/* The rtc core keeps the expiries of its timers, the alarm and the update
+ * interrupts among them, in the view of whoever armed them, but compares
+ * them with the time read by its worker, which sees the instance as it is.
+ * So with the views, only the initial namespace gets the alarms. */
+static int virt_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	if (virt_rtc_ns_current()) {
+		return -EOPNOTSUPP;
+	}
+
+	alrm->time = rtc_ktime_to_tm(vrtc->alarm_time);
+	alrm->enabled = vrtc->alarm_enabled;
+	alrm->pending = vrtc->alarm_enabled &&
+			!hrtimer_active(&vrtc->alarm_timer);
+
+	return 0;
+}
+
+static int virt_rtc_set_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	if (virt_rtc_ns_current()) {
+		return -EOPNOTSUPP;
+	}
+
+	hrtimer_cancel(&vrtc->alarm_timer);
+
+	vrtc->alarm_time = rtc_tm_to_ktime(alrm->time);
+	vrtc->alarm_enabled = alrm->enabled;
+	if (vrtc->alarm_enabled) {
+		alarm_arm(vrtc);
+	}
+
+	return 0;
+}
+
+static int virt_rtc_alarm_irq_enable(struct device *dev, unsigned int enabled)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	hrtimer_cancel(&vrtc->alarm_timer);
+
+	vrtc->alarm_enabled = enabled;
+	if (vrtc->alarm_enabled) {
+		alarm_arm(vrtc);
+	}
+
+	return 0;
+}
+
+/* Changes the pace of the time. The watchers of the control device are left
+ * to the caller. Must be called under rtc->ops_lock, which is what keeps the
+ * rate fields of the anchor stable. */
+static int change_rate(struct virt_rtc *vrtc, u32 num, u32 den, s32 ppb)
+{
+	spin_lock_bh(&vrtc->lock);
+	int err = virt_rtc_set_rate(timebase, &vrtc->anchor, timebase_now(),
+				    num, den, ppb);
+	if (!err) {
+		latch_anchor(vrtc);
+		virt_rtc_page_publish(vrtc);
+	}
+	spin_unlock_bh(&vrtc->lock);
+
+	if (!err) {
+		alarm_rearm(vrtc);
+		count_change(vrtc);
+	}
+	return err;
+}
+
+static int virt_rtc_read_offset(struct device *dev, long *offset)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	struct virt_rtc_anchor anchor;
+	read_anchor(vrtc, &anchor);
+
+	*offset = anchor.ppb;
+	return 0;
+}
+
+/* Steers the time without stepping it. */
+static int virt_rtc_set_offset(struct device *dev, long offset)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	if (offset < -VIRTRTC_MAX_PPB || offset > VIRTRTC_MAX_PPB) {
+		return -ERANGE;
+	}
+
+	int err = change_rate(vrtc, vrtc->anchor.rate_num,
+			      vrtc->anchor.rate_den, offset);
+	if (!err) {
+		virt_rtc_ctl_wake();
+	}
+	return err;
+}
+
+static struct rtc_class_ops virt_rtc_ops = {
+	.read_time = virt_rtc_read_time,
+	.set_time = virt_rtc_set_time,
+	.read_alarm = virt_rtc_read_alarm,
+	.set_alarm = virt_rtc_set_alarm,
+	.alarm_irq_enable = virt_rtc_alarm_irq_enable,
+	.read_offset = virt_rtc_read_offset,
+	.set_offset = virt_rtc_set_offset,
+};
+
+void virt_rtc_save(struct virt_rtc *vrtc, struct virtrtc_state_record *rec)
+{
+	struct virt_rtc_anchor anchor;
+	read_anchor(vrtc, &anchor);
+
+	ktime_t real = ktime_get_real();
+	ktime_t time = virt_rtc_extrapolate(timebase, &anchor, timebase_now());
+
+	memset(rec, 0, sizeof(*rec));
+	rec->flags = VIRTRTC_STATE_PRESENT;
+	rec->rate_num = anchor.rate_num;
+	rec->rate_den = anchor.rate_den;
+	rec->ppb = anchor.ppb;
+	rec->offset = ktime_to_ns(ktime_sub(time, real));
+}
+
+int virt_rtc_restore(struct virt_rtc *vrtc,
+		     const struct virtrtc_state_record *rec)
+{
+	mutex_lock(&vrtc->rtc->ops_lock);
+	int err = change_rate(vrtc, rec->rate_num, rec->rate_den, rec->ppb);
+	if (!err) {
+		step_time(vrtc, ktime_add_ns(ktime_get_real(), rec->offset));
+	}
+	mutex_unlock(&vrtc->rtc->ops_lock);
+
+	return err;
+}
+
+static unsigned int rate_num = 1;
+module_param(rate_num, uint, 0444);
+MODULE_PARM_DESC(rate_num,
+		 "Numerator of the initial pace of the time (default: 1)");
+
+static unsigned int rate_den = 1;
+module_param(rate_den, uint, 0444);
+MODULE_PARM_DESC(rate_den,
+		 "Denominator of the initial pace of the time (default: 1)");
+
+static ssize_t rate_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	struct virt_rtc_anchor anchor;
+	read_anchor(vrtc, &anchor);
+
+	return sprintf(buf, "%u/%u\n", anchor.rate_num, anchor.rate_den);
+}
+
+static ssize_t rate_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	unsigned int num = 0;
+	unsigned int den = 1;
+	int err = 0;
+
+	if (sscanf(buf, "%u/%u", &num, &den) < 1) {
+		return -EINVAL;
+	}
+
+	/* The correction stays. */
+	mutex_lock(&vrtc->rtc->ops_lock);
+	err = change_rate(vrtc, num, den, vrtc->anchor.ppb);
+	mutex_unlock(&vrtc->rtc->ops_lock);
+	if (err < 0) {
+		return err;
+	}
+
+	virt_rtc_ctl_wake();
+	return count;
+}
+static DEVICE_ATTR_RW(rate);
+
+/* The offset of the virtual time from CLOCK_REALTIME, in nanoseconds.
+ * Unlike RTC_SET_TIME, it isn't truncated to seconds. */
+static ssize_t offset_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n",
+		       ktime_to_ns(ktime_sub(virt_rtc_now(vrtc),
+					     ktime_get_real())));
+}
+
+static ssize_t offset_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	s64 offset = 0;
+
+	int err = kstrtos64(buf, 0, &offset);
+	if (err < 0) {
+		return err;
+	}
+
+	virt_rtc_step(vrtc, offset, true);
+	virt_rtc_ctl_wake();
+
+	return count;
+}
+static DEVICE_ATTR_RW(offset);
+
+/* Views of the instance from time namespaces, as "inum offset" lines.
+ * Writing "inum offset" sets a view, "inum" alone deletes it. */
+static ssize_t ns_offsets_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return virt_rtc_ns_show(vrtc->id, buf);
+}
+
+static ssize_t ns_offsets_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	unsigned int inum = 0;
+	long long offset = 0;
+	int err = 0;
+
+	switch (sscanf(buf, "%u %lld", &inum, &offset)) {
+	case 1:
+		err = virt_rtc_ns_del(vrtc->id, inum);
+		break;
+	case 2:
+		err = virt_rtc_ns_set(vrtc->id, inum, offset);
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
+	if (!err) {
+		notify_change(vrtc);
+	}
+
+	return err < 0 ? err : count;
+}
+static DEVICE_ATTR_RW(ns_offsets);
+
+/* The number of times the time has been changed. Supports poll(). */
+static ssize_t changes_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", atomic64_read(&vrtc->changes));
+}
+static DEVICE_ATTR_RO(changes);
+
+static ssize_t cpu_show(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", vrtc->cpu);
+}
+static DEVICE_ATTR_RO(cpu);
+
+/* The driver core creates the attributes once the probe succeeds and
+ * removes them before the resources are released, so they may use
+ * vrtc->rtc. */
+static struct attribute *virt_rtc_attrs[] = {
+	&dev_attr_rate.attr,
+	&dev_attr_offset.attr,
+	&dev_attr_cpu.attr,
+	&dev_attr_ns_offsets.attr,
+	&dev_attr_changes.attr,
+	NULL,
+};
+
+static const struct attribute_group virt_rtc_group = {
+	.attrs = virt_rtc_attrs,
+};
+
+static const struct attribute_group *virt_rtc_groups[] = {
+	&virt_rtc_group,
+	&virt_rtc_fault_group,
+	&virt_rtc_replay_group,
+	NULL,
+};
+
+/* Time bases differ in what they do across a suspend: jiffies, mono_fast
+ * and raw stop, while boot and real keep going. So the time is carried over
+ * a suspend explicitly, by CLOCK_BOOTTIME if the suspended time counts and
+ * by CLOCK_MONOTONIC otherwise, and the instance is re-anchored on resume.
+ * That also spares the first update after resume a huge delta. */
+static u64 suspend_clock_now(bool counts)
+{
+	return counts ? ktime_get_boottime_ns() : ktime_get_ns();
+}
+
+/* By default, the time runs while suspended only if its time base does. */
+static bool suspend_counts(void)
+{
+	int counts = READ_ONCE(count_suspend);
+
+	if (counts < 0) {
+		return timebase == TIMEBASE_BOOT || timebase == TIMEBASE_REAL;
+	}
+	return counts;
+}
+
+static int __maybe_unused virt_rtc_suspend(struct device *dev)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+
+	if (!vrtc || !vrtc->rtc_registered) {
+		return 0;
+	}
+
+	spin_lock_bh(&vrtc->lock);
+	vrtc->suspend_counts = suspend_counts();
+	vrtc->suspend_clock = suspend_clock_now(vrtc->suspend_counts);
+	vrtc->suspend_time =
+		virt_rtc_extrapolate(timebase, &vrtc->anchor, timebase_now());
+	spin_unlock_bh(&vrtc->lock);
+
+	return 0;
+}
+
+static int __maybe_unused virt_rtc_resume(struct device *dev)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	u32 frac = 0;
+
+	/* Neither was it suspended then. */
+	if (!vrtc || !vrtc->rtc_registered) {
+		return 0;
+	}
+
+	mutex_lock(&vrtc->rtc->ops_lock);
+
+	spin_lock_bh(&vrtc->lock);
+	u64 elapsed = suspend_clock_now(vrtc->suspend_counts) -
+		      vrtc->suspend_clock;
+	ktime_t time = ktime_add_ns(vrtc->suspend_time,
+				    virt_rtc_scale(&vrtc->anchor, elapsed, &frac));
+	virt_rtc_anchor_set(&vrtc->anchor, time, timebase_now());
+	latch_anchor(vrtc);
+	virt_rtc_page_publish(vrtc);
+	spin_unlock_bh(&vrtc->lock);
+
+	/* The expiry was computed for the old anchor. */
+	alarm_rearm(vrtc);
+	/* Whoever extrapolates the time by its base has to re-read it. */
+	notify_change(vrtc);
+
+	mutex_unlock(&vrtc->rtc->ops_lock);
+
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(virt_rtc_pm_ops, virt_rtc_suspend, virt_rtc_resume);
+
+static int err_to_rc(long err)
+{
+	int ret = (int)err; /* At the time of writing,
+			     * there were not so many errors to overflow any int. */
+	if (unlikely(ret < err)) {
+		BUG();
+	}
+	return ret;
+}
+
+/* Releases of the probe's resources, run by devres in the reverse order. */
+static void free_instance(void *vrtc)
+{
+	kmem_cache_free(vrtc_cache, vrtc);
+}
+
+static void free_time_page(void *vrtc)
+{
+	virt_rtc_page_free(vrtc);
+}
+
+static void cancel_alarm(void *data)
+{
+	struct virt_rtc *vrtc = data;
+
+	/* The rtc device is unregistered, so nobody can arm the alarm
+	 * anymore. But an armed one may still fire and raise an interrupt on
+	 * the rtc device, so the probe holds it until the alarm is gone. */
+	hrtimer_cancel(&vrtc->alarm_timer);
+	if (!IS_ERR_OR_NULL(vrtc->rtc)) {
+		put_device(&vrtc->rtc->dev);
+	}
+}
+
+static void unguard(void *vrtc)
+{
+	guard_del(vrtc);
+}
+
+static void clear_faults(void *vrtc)
+{
+	virt_rtc_fault_clear(vrtc);
+}
+
+static void clear_replay(void *vrtc)
+{
+	virt_rtc_replay_clear(vrtc);
+}
+
+static void rtc_unregistered(void *vrtc)
+{
+	((struct virt_rtc *)vrtc)->rtc_registered = false;
+}
+
+/* Every instance is a platform device, virtrtc.<id>. Its resources are
+ * managed by devres and released once it's unregistered. */
+static int virt_rtc_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	const int *cpu = dev_get_platdata(dev);
+
+	/* The node is that of the CPU hint, if there is one. */
+	struct virt_rtc *vrtc = kmem_cache_alloc_node(
+		vrtc_cache, GFP_KERNEL | __GFP_ZERO, dev_to_node(dev));
+	if (!vrtc) {
+		return -ENOMEM;
+	}
+	/* Before anything that calls the ops back, as registering the rtc
+	 * does. The driver core clears it if the probe fails. */
+	platform_set_drvdata(pdev, vrtc);
+	int err = devm_add_action_or_reset(dev, free_instance, vrtc);
+	if (err < 0) {
+		return err;
+	}
+	/* Drops the instance's hold on the fault key. */
+	err = devm_add_action_or_reset(dev, clear_faults, vrtc);
+	if (err < 0) {
+		return err;
+	}
+	virt_rtc_replay_init(vrtc);
+	err = devm_add_action_or_reset(dev, clear_replay, vrtc);
+	if (err < 0) {
+		return err;
+	}
+
+	vrtc->id = pdev->id;
+	vrtc->dev = dev;
+	vrtc->cpu = cpu ? *cpu : -1;
+	u64 now = timebase_now();
+	virt_rtc_anchor_set(&vrtc->anchor, ktime_get_real(), now);
+	/* Checked by virt_rtc_init(). */
+	WARN_ON(virt_rtc_set_rate(timebase, &vrtc->anchor, now, rate_num,
+				  rate_den, 0));
+	spin_lock_init(&vrtc->lock);
+	seqcount_init(&vrtc->latch);
+	latch_anchor(vrtc);
+
+	err = virt_rtc_page_alloc(vrtc);
+	if (err < 0) {
+		return err;
+	}
+	err = devm_add_action_or_reset(dev, free_time_page, vrtc);
+	if (err < 0) {
+		return err;
+	}
+	virt_rtc_page_publish(vrtc);
+
+	hrtimer_init(&vrtc->alarm_timer, alarm_clockid(), HRTIMER_MODE_ABS);
+	vrtc->alarm_timer.function = virt_rtc_alarm_fire;
+	err = devm_add_action_or_reset(dev, cancel_alarm, vrtc);
+	if (err < 0) {
+		return err;
+	}
+
+	vrtc->rtc = devm_rtc_allocate_device(dev);
+	if (IS_ERR(vrtc->rtc)) {
+		dev_err(dev, "failed to create rtc device\n");
+		return PTR_ERR(vrtc->rtc);
+	}
+	/* Dropped by cancel_alarm(). */
+	get_device(&vrtc->rtc->dev);
+
+	vrtc->rtc->ops = &virt_rtc_ops;
+	/* Periodic interrupts are emulated by the rtc core itself. */
+	vrtc->rtc->max_user_freq = max_user_freq;
+
+	err = rtc_register_device(vrtc->rtc);
+	if (err < 0) {
+		dev_err(dev, "failed to register rtc device\n");
+		return err;
+	}
+	/* The PM callbacks leave the instance alone until now, and again
+	 * once the rtc is about to be unregistered. They are serialized
+	 * with the probe and the removal by the device lock. */
+	vrtc->rtc_registered = true;
+	err = devm_add_action_or_reset(dev, rtc_unregistered, vrtc);
+	if (err < 0) {
+		return err;
+	}
+
+	if (timebase == TIMEBASE_JIFFIES) {
+		guard_add(vrtc);
+		err = devm_add_action_or_reset(dev, unguard, vrtc);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+#define VIRTRTC_DRV_NAME "virtrtc"
+
+static struct platform_driver virt_rtc_driver = {
+	.probe = virt_rtc_probe,
+	.driver = {
+		.name = VIRTRTC_DRV_NAME,
+		.pm = &virt_rtc_pm_ops,
+		.dev_groups = virt_rtc_groups,
+		/* Instances come and go only with their devices. */
+		.suppress_bind_attrs = true,
+	},
+};
+
+static struct virt_rtc *create_instance(unsigned int id, int cpu)
+{
+	long err = 0;
+
+	struct platform_device *pdev = platform_device_alloc(VIRTRTC_DRV_NAME,
+							     id);
+	if (!pdev) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	if (cpu >= 0) {
+		set_dev_node(&pdev->dev, cpu_to_node(cpu));
+		err = platform_device_add_data(pdev, &cpu, sizeof(cpu));
+		if (err < 0) {
+			goto err_put;
+		}
+	}
+
+	err = platform_device_add(pdev);
+	if (err < 0) {
+		goto err_put;
+	}
+
+	/* The probe runs right away and clears the data if it fails. */
+	struct virt_rtc *vrtc = platform_get_drvdata(pdev);
+	if (!vrtc) {
+		platform_device_unregister(pdev);
+		return ERR_PTR(-ENODEV);
+	}
+	return vrtc;
+
+err_put:
+	platform_device_put(pdev);
+err:
+	pr_err("failed to create virtrtc.%u device\n", id);
+	return ERR_PTR(err);
+}
+
+static void destroy_instance(struct virt_rtc *vrtc)
+{
+	unsigned int id = vrtc->id;
+
+	platform_device_unregister(to_platform_device(vrtc->dev));
+	/* There are no readers anymore. */
+	virt_rtc_ns_forget(id);
+}
+
+struct virt_rtc *virt_rtc_get(unsigned int id)
+{
+	lockdep_assert_held(&virt_rtc_instances_lock);
+	return xa_load(&vrtcs, id);
+}
+
+struct virt_rtc *virt_rtc_next(unsigned int *id)
+{
+	unsigned long index = *id;
+
+	lockdep_assert_held(&virt_rtc_instances_lock);
+	struct virt_rtc *vrtc = xa_find(&vrtcs, &index, ULONG_MAX, XA_PRESENT);
+	*id = index;
+	return vrtc;
+}
+
+int virt_rtc_add(unsigned int id, int cpu)
+{
+	int err = 0;
+
+	if (id >= VIRTRTC_MAX_INSTANCES) {
+		return -EINVAL;
+	}
+	if (cpu < -1 ||
+	    (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_possible(cpu)))) {
+		return -EINVAL;
+	}
+
+	/* Reserves the id. */
+	mutex_lock(&virt_rtc_instances_lock);
+	err = xa_insert(&vrtcs, id, NULL, GFP_KERNEL);
+	mutex_unlock(&virt_rtc_instances_lock);
+	if (err < 0) {
+		return err == -EBUSY ? -EEXIST : err;
+	}
+
+	struct virt_rtc *vrtc = create_instance(id, cpu);
+
+	mutex_lock(&virt_rtc_instances_lock);
+	if (IS_ERR(vrtc)) {
+		err = PTR_ERR(vrtc);
+		xa_release(&vrtcs, id);
+	} else {
+		/* The reserved entry needs no memory. */
+		xa_store(&vrtcs, id, vrtc, GFP_KERNEL);
+	}
+	mutex_unlock(&virt_rtc_instances_lock);
+
+	return err;
+}
+
+int virt_rtc_del(unsigned int id)
+{
+	mutex_lock(&virt_rtc_instances_lock);
+	/* Not xa_erase() right away: it would drop a reservation too. */
+	struct virt_rtc *vrtc = xa_load(&vrtcs, id);
+	if (vrtc) {
+		xa_erase(&vrtcs, id);
+		destroy_instance(vrtc);
+	}
+	mutex_unlock(&virt_rtc_instances_lock);
+
+	return vrtc ? 0 : -ENOENT;
+}
+
+static void add_async(void *data, async_cookie_t cookie __always_unused)
+{
+	unsigned int id = (unsigned long)data;
+
+	int err = virt_rtc_add(id, -1);
+	if (err < 0) {
+		pr_err("failed to create instance %u: %d\n", id, err);
+	}
+}
+
+static void destroy_async(void *data, async_cookie_t cookie __always_unused)
+{
+	destroy_instance(data);
+}
+
+/* Instances are independent, so they are destroyed in parallel. */
+static void destroy_instances(void)
+{
+	struct virt_rtc *vrtc = NULL;
+	unsigned long id = 0;
+
+	/* Creations first, so none is left behind. */
+	async_synchronize_full_domain(&virt_rtc_async);
+
+	mutex_lock(&virt_rtc_instances_lock);
+	xa_for_each (&vrtcs, id, vrtc) {
+		xa_erase(&vrtcs, id);
+		async_schedule_domain(destroy_async, vrtc, &virt_rtc_async);
+	}
+	mutex_unlock(&virt_rtc_instances_lock);
+
+	async_synchronize_full_domain(&virt_rtc_async);
+}
+
+static int virt_rtc_init(void)
+{
+	long err = 0;
+
+	err = match_string(timebase_names, ARRAY_SIZE(timebase_names),
+			   timebase_param);
+	if (err < 0) {
+		pr_err("unknown time base %s\n", timebase_param);
+		goto err;
+	}
+	timebase = err;
+
+	if (instances > VIRTRTC_MAX_INSTANCES) {
+		pr_err("instances must be at most %u\n", VIRTRTC_MAX_INSTANCES);
+		err = -EINVAL;
+		goto err;
+	}
+
+	u32 mult = 0;
+	u32 shift = 0;
+	err = virt_rtc_calc_rate(rate_num, rate_den, 0, &mult, &shift);
+	if (err < 0) {
+		pr_err("unsupported rate %u/%u\n", rate_num, rate_den);
+		goto err;
+	}
+
+	if (guard_interval < 1 || guard_interval > VIRTRTC_GUARD_MAX_SECS) {
+		guard_interval = clamp_val(guard_interval, 1,
+					   VIRTRTC_GUARD_MAX_SECS);
+		pr_warn("guard_interval is out of range, using %u\n",
+			guard_interval);
+	}
+	guard_jiffies = (unsigned long)guard_interval * HZ;
+
+	vrtc_cache = KMEM_CACHE(virt_rtc, SLAB_HWCACHE_ALIGN);
+	if (!vrtc_cache) {
+		pr_err("failed to create instances cache\n");
+		err = -ENOMEM;
+		goto err;
+	}
+
+	err = platform_driver_register(&virt_rtc_driver);
+	if (err < 0) {
+		pr_err("failed to register virtrtc driver\n");
+		goto err_destroy_cache;
+	}
+
+	guards_init();
+	virt_rtc_stats_init();
+
+	unsigned int id = 0;
+	for (id = 0; id < instances; id++) {
+		if (async_register) {
+			/* Errors only make it to the log. */
+			async_schedule_domain(add_async, (void *)(unsigned long)id,
+					      &virt_rtc_async);
+			continue;
+		}
+
+		err = virt_rtc_add(id, -1);
+		if (err < 0) {
+			goto err_destroy_instances;
+		}
+	}
+
+	err = virt_rtc_ctl_init();
+	if (err < 0) {
+		goto err_destroy_instances;
+	}
+
+	return err_to_rc(err);
+
+err_destroy_instances:
+	destroy_instances();
+	virt_rtc_stats_exit();
+	guards_exit();
+	platform_driver_unregister(&virt_rtc_driver);
+err_destroy_cache:
+	kmem_cache_destroy(vrtc_cache);
+err:
+	return err_to_rc(err);
+}
+
+static void virt_rtc_exit(void)
+{
+	virt_rtc_ctl_exit();
+	/* The statistics go after the instances, whose reads log into the
+	 * flight recorder until they're gone. */
+	destroy_instances();
+	virt_rtc_stats_exit();
+	guards_exit();
+	platform_driver_unregister(&virt_rtc_driver);
+	kmem_cache_destroy(vrtc_cache);
+}
+
+module_init(virt_rtc_init);
+module_exit(virt_rtc_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Virtual (not real) RTC device. Repository: https://github.com/mlyapin/virtrtc");
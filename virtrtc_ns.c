@@ -0,0 +1,177 @@
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/nsproxy.h>
+#include <linux/time_namespace.h>
+#include <linux/proc_ns.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "virtrtc.h"
+
+/* Views of the instances from time namespaces. A view is an offset added
+ * to the time of an instance for the tasks of one namespace, so a single
+ * /dev/rtcN can show every container a time of its own.
+ *
+ * Namespaces are told apart by their inode numbers, the ones in
+ * /proc/<pid>/ns/time. Nothing tells a module that a namespace is gone, so
+ * views outlive their namespaces until they're deleted or the instance is,
+ * and an inode number that gets reused inherits the view.
+ *
+ * Views of all the instances share one hash table, keyed by the instance
+ * and the namespace. Readers look it up under RCU, writers take views_lock. */
+
+/* Also bounds the memory taken by the forgotten views. */
+#define VIRTRTC_MAX_NS_VIEWS 65536
+
+struct ns_view {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u64 key;
+	s64 offset;
+};
+
+static DEFINE_HASHTABLE(views, 10);
+static DEFINE_SPINLOCK(views_lock);
+static unsigned int nr_views;
+
+static u64 view_key(unsigned int id, unsigned int inum)
+{
+	return (u64)id << 32 | inum;
+}
+
+/* Must be called under RCU or views_lock. */
+static struct ns_view *find_view(u64 key)
+{
+	struct ns_view *view = NULL;
+
+	hash_for_each_possible_rcu (views, view, node, key) {
+		if (view->key == key) {
+			return view;
+		}
+	}
+	return NULL;
+}
+
+unsigned int virt_rtc_ns_current(void)
+{
+	/* Exiting tasks have no namespaces anymore. */
+	struct nsproxy *nsproxy = current->nsproxy;
+	if (!nsproxy || nsproxy->time_ns->ns.inum == PROC_TIME_INIT_INO) {
+		return 0;
+	}
+	return nsproxy->time_ns->ns.inum;
+}
+
+s64 virt_rtc_ns_offset(unsigned int id, unsigned int inum)
+{
+	s64 offset = 0;
+
+	/* The initial namespace never has a view of its own. */
+	if (!inum || !READ_ONCE(nr_views)) {
+		return 0;
+	}
+
+	rcu_read_lock();
+	struct ns_view *view = find_view(view_key(id, inum));
+	if (view) {
+		offset = READ_ONCE(view->offset);
+	}
+	rcu_read_unlock();
+
+	return offset;
+}
+
+int virt_rtc_ns_set(unsigned int id, unsigned int inum, s64 offset)
+{
+	int err = 0;
+
+	if (!inum || inum == PROC_TIME_INIT_INO) {
+		return -EINVAL;
+	}
+
+	/* Allocated ahead, since the view may be new. */
+	struct ns_view *new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new) {
+		return -ENOMEM;
+	}
+
+	spin_lock(&views_lock);
+
+	u64 key = view_key(id, inum);
+	struct ns_view *view = find_view(key);
+	if (view) {
+		WRITE_ONCE(view->offset, offset);
+	} else if (nr_views >= VIRTRTC_MAX_NS_VIEWS) {
+		err = -ENOSPC;
+	} else {
+		new->key = key;
+		new->offset = offset;
+		hash_add_rcu(views, &new->node, key);
+		WRITE_ONCE(nr_views, nr_views + 1);
+		new = NULL;
+	}
+
+	spin_unlock(&views_lock);
+
+	kfree(new);
+	return err;
+}
+
+static void del_view(struct ns_view *view)
+{
+	hash_del_rcu(&view->node);
+	kfree_rcu(view, rcu);
+	WRITE_ONCE(nr_views, nr_views - 1);
+}
+
+int virt_rtc_ns_del(unsigned int id, unsigned int inum)
+{
+	spin_lock(&views_lock);
+	struct ns_view *view = find_view(view_key(id, inum));
+	if (view) {
+		del_view(view);
+	}
+	spin_unlock(&views_lock);
+
+	return view ? 0 : -ENOENT;
+}
+
+ssize_t virt_rtc_ns_show(unsigned int id, char *buf)
+{
+	struct ns_view *view = NULL;
+	unsigned int bkt = 0;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	hash_for_each_rcu (views, bkt, view, node) {
+		if (view->key >> 32 == id) {
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%u %lld\n", (unsigned int)view->key,
+					 READ_ONCE(view->offset));
+		}
+	}
+	rcu_read_unlock();
+
+	return len;
+}
+
+void virt_rtc_ns_forget(unsigned int id)
+{
+	struct ns_view *view = NULL;
+	struct hlist_node *tmp = NULL;
+	unsigned int bkt = 0;
+
+	if (!READ_ONCE(nr_views)) {
+		return;
+	}
+
+	spin_lock(&views_lock);
+	hash_for_each_safe (views, bkt, tmp, view, node) {
+		if (view->key >> 32 == id) {
+			del_view(view);
+		}
+	}
+	spin_unlock(&views_lock);
+}
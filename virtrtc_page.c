@@ -0,0 +1,79 @@
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/mutex.h>
+#include <linux/device.h>
+#include <linux/timekeeping.h>
+
+#include "virtrtc.h"
+
+/* Userspace reads the time from a mapped copy of the instance's state,
+ * without any syscalls. The copy is updated by the writers of the state
+ * and has its own sequence counter, since seqlock_t can't be shared. */
+
+int virt_rtc_page_alloc(struct virt_rtc *vrtc)
+{
+	vrtc->page = alloc_pages_node(dev_to_node(vrtc->dev),
+				      GFP_KERNEL | __GFP_ZERO, 0);
+	if (!vrtc->page) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void virt_rtc_page_free(struct virt_rtc *vrtc)
+{
+	/* Userspace mappings hold their own references to the page. */
+	put_page(vrtc->page);
+	vrtc->page = NULL;
+}
+
+void virt_rtc_page_publish(struct virt_rtc *vrtc)
+{
+	struct virtrtc_time_page *tp = page_address(vrtc->page);
+
+	WRITE_ONCE(tp->seq, tp->seq + 1);
+	smp_wmb();
+
+	tp->timebase = timebase;
+	tp->last_time = ktime_to_ns(vrtc->anchor.last_time);
+	tp->last_base = vrtc->anchor.last_base;
+	tp->last_mono = timebase == TIMEBASE_JIFFIES ? ktime_get_ns() : 0;
+	tp->mult = vrtc->anchor.mult;
+	tp->shift = vrtc->anchor.shift;
+
+	smp_wmb();
+	WRITE_ONCE(tp->seq, tp->seq + 1);
+}
+
+int virt_rtc_page_mmap(struct vm_area_struct *vma)
+{
+	int err = 0;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+	if (vma->vm_pgoff >= VIRTRTC_MAX_INSTANCES) {
+		return -ENXIO;
+	}
+
+	/* Keeps the instance, and so its page, alive until the page is
+	 * mapped. Then the mapping holds a reference of its own. */
+	mutex_lock(&virt_rtc_instances_lock);
+
+	struct virt_rtc *vrtc = virt_rtc_get(vma->vm_pgoff);
+	if (!vrtc) {
+		err = -ENXIO;
+		goto out;
+	}
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	err = vm_insert_page(vma, vma->vm_start, vrtc->page);
+
+out:
+	mutex_unlock(&virt_rtc_instances_lock);
+	return err;
+}
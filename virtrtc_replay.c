@@ -0,0 +1,389 @@
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/rcupdate.h>
+
+#include "virtrtc.h"
+
+/* Replay of recorded timelines, for reproducible tests. While an instance
+ * replays a timeline, its reads return the time interpolated between
+ * the points instead of its own, which keeps running underneath: sets,
+ * alarms, the time page and the rest still go by it.
+ *
+ * Points are looked up by a binary search, so timelines may be long. Sets of
+ * the time may be recorded into a ring, and read back as a timeline. */
+
+DEFINE_STATIC_KEY_FALSE(virt_rtc_replaying);
+
+/* The header and the points take the same slots, see struct
+ * virtrtc_timeline_header. */
+#define TIMELINE_SLOT sizeof(struct virtrtc_timeline_point)
+
+/* start is the time base reading the bases of the points count from. */
+struct virt_rtc_timeline {
+	u64 start;
+	u32 count;
+	struct virtrtc_timeline_point points[];
+};
+
+static struct virt_rtc_timeline *alloc_timeline(u32 count)
+{
+	struct virt_rtc_timeline *tl =
+		kvmalloc(struct_size(tl, points, count), GFP_KERNEL);
+	if (tl) {
+		tl->start = virt_rtc_timebase_now();
+		tl->count = count;
+	}
+	return tl;
+}
+
+/* Nanoseconds of the time base elapsed since the start of the timeline. */
+static u64 timeline_elapsed(const struct virt_rtc_timeline *tl, u64 now)
+{
+	return virt_rtc_base_nsecs(timebase,
+				   virt_rtc_base_delta(timebase, tl->start, now));
+}
+
+/* dv * dt / span, with dt <= span. The low bits of dt and span are dropped
+ * if the product would overflow, which keeps anything but the last
+ * nanoseconds. */
+static s64 interpolate(s64 dv, u64 dt, u64 span)
+{
+	u64 adv = dv < 0 ? -(u64)dv : dv;
+
+	int drop = fls64(adv) + fls64(dt) - 64;
+	if (drop > 0) {
+		dt >>= drop;
+		span >>= drop;
+	}
+	if (!span) {
+		return 0;
+	}
+
+	u64 v = div64_u64(adv * dt, span);
+	return dv < 0 ? -(s64)v : v;
+}
+
+static ktime_t timeline_at(const struct virt_rtc_timeline *tl, u64 now)
+{
+	const struct virtrtc_timeline_point *points = tl->points;
+	u64 t = timeline_elapsed(tl, now);
+	u32 lo = 0;
+	u32 hi = tl->count;
+
+	/* Finds the first point past t. */
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if ((u64)points[mid].base <= t) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0) {
+		return points[0].time;
+	}
+	const struct virtrtc_timeline_point *p = &points[lo - 1];
+	if (lo == tl->count) {
+		return ktime_add_ns(p->time, t - p->base);
+	}
+	return ktime_add_ns(p->time, interpolate(p[1].time - p->time,
+						 t - p->base,
+						 p[1].base - p->base));
+}
+
+bool virt_rtc_replay_time(struct virt_rtc *vrtc, u64 now, ktime_t *time)
+{
+	bool replaying = false;
+
+	rcu_read_lock();
+	struct virt_rtc_timeline *tl = rcu_dereference(vrtc->replay.timeline);
+	if (tl) {
+		*time = timeline_at(tl, now);
+		replaying = true;
+	}
+	rcu_read_unlock();
+
+	return replaying;
+}
+
+/* Must be called under replay.lock. */
+static void replace_timeline(struct virt_rtc *vrtc,
+			     struct virt_rtc_timeline *tl)
+{
+	struct virt_rtc_replay *r = &vrtc->replay;
+
+	struct virt_rtc_timeline *old =
+		rcu_dereference_protected(r->timeline,
+					  lockdep_is_held(&r->lock));
+	rcu_assign_pointer(r->timeline, tl);
+
+	if (!old && tl) {
+		static_branch_inc(&virt_rtc_replaying);
+	} else if (old && !tl) {
+		static_branch_dec(&virt_rtc_replaying);
+	}
+
+	if (old) {
+		synchronize_rcu();
+		kvfree(old);
+	}
+}
+
+void virt_rtc_replay_record(struct virt_rtc *vrtc, ktime_t time)
+{
+	struct virt_rtc_replay *r = &vrtc->replay;
+
+	if (!READ_ONCE(r->recording)) {
+		return;
+	}
+
+	mutex_lock(&r->lock);
+	if (r->recording) {
+		struct virt_rtc_timeline *rec = r->rec;
+		struct virtrtc_timeline_point *p = &rec->points[r->rec_next];
+
+		s64 base = timeline_elapsed(rec, virt_rtc_timebase_now());
+		/* Sets within a jiffy read the same base, but the bases of
+		 * a timeline have to increase to be replayed. */
+		if (r->rec_len) {
+			u32 prev = (r->rec_next + rec->count - 1) % rec->count;
+			base = max(base, rec->points[prev].base + 1);
+		}
+		p->base = base;
+		p->time = ktime_to_ns(time);
+		r->rec_next = (r->rec_next + 1) % r->rec->count;
+		r->rec_len = min(r->rec_len + 1, r->rec->count);
+	}
+	mutex_unlock(&r->lock);
+}
+
+void virt_rtc_replay_init(struct virt_rtc *vrtc)
+{
+	mutex_init(&vrtc->replay.lock);
+}
+
+void virt_rtc_replay_clear(struct virt_rtc *vrtc)
+{
+	struct virt_rtc_replay *r = &vrtc->replay;
+
+	mutex_lock(&r->lock);
+	replace_timeline(vrtc, NULL);
+	kvfree(r->loading);
+	r->loading = NULL;
+	r->recording = false;
+	kvfree(r->rec);
+	r->rec = NULL;
+	mutex_unlock(&r->lock);
+}
+
+static void fill_timeline_header(struct virtrtc_timeline_header *hdr,
+				 u32 count)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = VIRTRTC_TIMELINE_MAGIC;
+	hdr->version = VIRTRTC_TIMELINE_VERSION;
+	hdr->count = count;
+}
+
+/* Must be called under replay.lock. */
+static int load_header(struct virt_rtc *vrtc,
+		       const struct virtrtc_timeline_header *hdr)
+{
+	struct virt_rtc_replay *r = &vrtc->replay;
+
+	/* reserved must be zero, so it can be given a meaning later. */
+	if (hdr->magic != VIRTRTC_TIMELINE_MAGIC ||
+	    hdr->version != VIRTRTC_TIMELINE_VERSION || hdr->reserved) {
+		return -EINVAL;
+	}
+	if (hdr->count > VIRTRTC_TIMELINE_MAX) {
+		return -E2BIG;
+	}
+
+	kvfree(r->loading);
+	r->loading = NULL;
+	r->loaded = 0;
+
+	if (!hdr->count) {
+		replace_timeline(vrtc, NULL);
+		return 0;
+	}
+	r->loading = alloc_timeline(hdr->count);
+	return r->loading ? 0 : -ENOMEM;
+}
+
+/* Must be called under replay.lock. */
+static int load_point(struct virt_rtc *vrtc, loff_t slot,
+		      const struct virtrtc_timeline_point *p)
+{
+	struct virt_rtc_replay *r = &vrtc->replay;
+	struct virt_rtc_timeline *tl = r->loading;
+
+	if (!tl || slot - 1 != r->loaded) {
+		return -EINVAL;
+	}
+	if (p->base < 0 ||
+	    (r->loaded && p->base <= tl->points[r->loaded - 1].base)) {
+		return -EINVAL;
+	}
+
+	tl->points[r->loaded++] = *p;
+	if (r->loaded == tl->count) {
+		/* The replay starts now. */
+		tl->start = virt_rtc_timebase_now();
+		r->loading = NULL;
+		replace_timeline(vrtc, tl);
+	}
+	return 0;
+}
+
+static ssize_t timeline_write(struct file *file, struct kobject *kobj,
+			      struct bin_attribute *attr, char *buf,
+			      loff_t off, size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(kobj_to_dev(kobj));
+	size_t done = 0;
+	int err = 0;
+
+	BUILD_BUG_ON(sizeof(struct virtrtc_timeline_header) != TIMELINE_SLOT);
+	if (off % TIMELINE_SLOT || count % TIMELINE_SLOT) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&vrtc->replay.lock);
+
+	loff_t slot = off / TIMELINE_SLOT;
+	for (; done < count; done += TIMELINE_SLOT, slot++) {
+		if (slot == 0) {
+			struct virtrtc_timeline_header hdr;
+
+			memcpy(&hdr, buf + done, sizeof(hdr));
+			err = load_header(vrtc, &hdr);
+		} else {
+			struct virtrtc_timeline_point p;
+
+			memcpy(&p, buf + done, sizeof(p));
+			err = load_point(vrtc, slot, &p);
+		}
+		if (err < 0) {
+			break;
+		}
+	}
+
+	mutex_unlock(&vrtc->replay.lock);
+
+	/* Report the loaded part, the rest fails on the next write. */
+	return done > 0 ? done : err;
+}
+static BIN_ATTR(timeline, 0200, NULL, timeline_write, 0);
+
+/* Recordings are read oldest first. Stop the recording beforehand, or sets
+ * in between the reads shift the ring. */
+static ssize_t recording_read(struct file *file, struct kobject *kobj,
+			      struct bin_attribute *attr, char *buf,
+			      loff_t off, size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(kobj_to_dev(kobj));
+	struct virt_rtc_replay *r = &vrtc->replay;
+	size_t done = 0;
+
+	if (off % TIMELINE_SLOT) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&r->lock);
+
+	u32 first = r->rec_len < (r->rec ? r->rec->count : 0) ? 0 : r->rec_next;
+	loff_t slot = off / TIMELINE_SLOT;
+	for (; done + TIMELINE_SLOT <= count; done += TIMELINE_SLOT, slot++) {
+		if (slot == 0) {
+			fill_timeline_header((void *)(buf + done), r->rec_len);
+			continue;
+		}
+		if (slot > r->rec_len) {
+			break;
+		}
+
+		u32 i = (first + (u32)slot - 1) % r->rec->count;
+		memcpy(buf + done, &r->rec->points[i], TIMELINE_SLOT);
+	}
+
+	mutex_unlock(&r->lock);
+	return done;
+}
+static BIN_ATTR(recording, 0400, recording_read, NULL, 0);
+
+static ssize_t record_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	struct virt_rtc_replay *r = &vrtc->replay;
+
+	mutex_lock(&r->lock);
+	u32 size = r->recording ? r->rec->count : 0;
+	mutex_unlock(&r->lock);
+
+	return sprintf(buf, "%u\n", size);
+}
+
+/* Starts recording the last so many sets, or stops if 0. The recording
+ * stays readable until the next one starts. */
+static ssize_t record_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct virt_rtc *vrtc = dev_get_drvdata(dev);
+	struct virt_rtc_replay *r = &vrtc->replay;
+	u32 size = 0;
+
+	int err = kstrtou32(buf, 0, &size);
+	if (err < 0) {
+		return err;
+	}
+	if (size > VIRTRTC_TIMELINE_MAX) {
+		return -E2BIG;
+	}
+
+	struct virt_rtc_timeline *rec = NULL;
+	if (size) {
+		rec = alloc_timeline(size);
+		if (!rec) {
+			return -ENOMEM;
+		}
+	}
+
+	mutex_lock(&r->lock);
+	if (rec) {
+		swap(r->rec, rec);
+		r->rec_next = 0;
+		r->rec_len = 0;
+	}
+	WRITE_ONCE(r->recording, size != 0);
+	mutex_unlock(&r->lock);
+
+	kvfree(rec);
+	return count;
+}
+static DEVICE_ATTR_RW(record);
+
+static struct attribute *virt_rtc_replay_attrs[] = {
+	&dev_attr_record.attr,
+	NULL,
+};
+
+static struct bin_attribute *virt_rtc_replay_bin_attrs[] = {
+	&bin_attr_timeline,
+	&bin_attr_recording,
+	NULL,
+};
+
+const struct attribute_group virt_rtc_replay_group = {
+	.name = "replay",
+	.attrs = virt_rtc_replay_attrs,
+	.bin_attrs = virt_rtc_replay_bin_attrs,
+};
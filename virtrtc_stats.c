@@ -0,0 +1,105 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/cpumask.h>
+
+#include "virtrtc.h"
+
+DEFINE_PER_CPU(struct virt_rtc_stats, virt_rtc_stats);
+DEFINE_STATIC_KEY_FALSE(virt_rtc_timing);
+
+static struct dentry *stats_dir;
+
+static void sum_stats(struct virt_rtc_stats *sum)
+{
+	unsigned int cpu = 0;
+	unsigned int i = 0;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu (cpu) {
+		const struct virt_rtc_stats *s = per_cpu_ptr(&virt_rtc_stats, cpu);
+
+		sum->reads += READ_ONCE(s->reads);
+		sum->read_retries += READ_ONCE(s->read_retries);
+		sum->tm_conversions += READ_ONCE(s->tm_conversions);
+		sum->sets += READ_ONCE(s->sets);
+		sum->timer_fires += READ_ONCE(s->timer_fires);
+		sum->guard_refreshes += READ_ONCE(s->guard_refreshes);
+		sum->write_holds += READ_ONCE(s->write_holds);
+		sum->write_hold_ns += READ_ONCE(s->write_hold_ns);
+		sum->faults += READ_ONCE(s->faults);
+		for (i = 0; i < VIRTRTC_LAT_BUCKETS; i++) {
+			sum->read_lat[i] += READ_ONCE(s->read_lat[i]);
+		}
+	}
+}
+
+static int stats_show(struct seq_file *m, void *v __always_unused)
+{
+	struct virt_rtc_stats sum;
+
+	sum_stats(&sum);
+
+	seq_printf(m, "reads: %llu\n", sum.reads);
+	seq_printf(m, "read_retries: %llu\n", sum.read_retries);
+	seq_printf(m, "tm_conversions: %llu\n", sum.tm_conversions);
+	seq_printf(m, "sets: %llu\n", sum.sets);
+	seq_printf(m, "timer_fires: %llu\n", sum.timer_fires);
+	seq_printf(m, "guard_refreshes: %llu\n", sum.guard_refreshes);
+	seq_printf(m, "write_holds: %llu\n", sum.write_holds);
+	seq_printf(m, "write_hold_ns: %llu\n", sum.write_hold_ns);
+	seq_printf(m, "faults: %llu\n", sum.faults);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int read_latency_show(struct seq_file *m, void *v __always_unused)
+{
+	struct virt_rtc_stats sum;
+	unsigned int i = 0;
+
+	sum_stats(&sum);
+
+	/* Each line is the lower bound of the bucket and its count. */
+	for (i = 0; i < VIRTRTC_LAT_BUCKETS; i++) {
+		seq_printf(m, "%llu %llu\n", 1ULL << i, sum.read_lat[i]);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(read_latency);
+
+static int timing_get(void *data __always_unused, u64 *val)
+{
+	*val = static_key_enabled(&virt_rtc_timing);
+	return 0;
+}
+
+static int timing_set(void *data __always_unused, u64 val)
+{
+	if (val) {
+		static_branch_enable(&virt_rtc_timing);
+	} else {
+		static_branch_disable(&virt_rtc_timing);
+	}
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(timing_fops, timing_get, timing_set, "%llu\n");
+
+void virt_rtc_stats_init(void)
+{
+	/* Debugfs is optional, so its errors are ignored. */
+	stats_dir = debugfs_create_dir("virtrtc", NULL);
+	debugfs_create_file("stats", 0444, stats_dir, NULL, &stats_fops);
+	debugfs_create_file("read_latency", 0444, stats_dir, NULL,
+			    &read_latency_fops);
+	debugfs_create_file_unsafe("timing", 0644, stats_dir, NULL,
+				   &timing_fops);
+	virt_rtc_flight_init(stats_dir);
+}
+
+void virt_rtc_stats_exit(void)
+{
+	debugfs_remove_recursive(stats_dir);
+	virt_rtc_flight_exit();
+}
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM virtrtc
+
+#if !defined(VIRTRTC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define VIRTRTC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/* The state was moved forward by delta units of the time base. */
+TRACE_EVENT(virtrtc_update_time,
+	    TP_PROTO(unsigned int id, u64 delta, ktime_t time),
+	    TP_ARGS(id, delta, time),
+	    TP_STRUCT__entry(__field(unsigned int, id) __field(u64, delta)
+				     __field(s64, time)),
+	    TP_fast_assign(__entry->id = id; __entry->delta = delta;
+			   __entry->time = ktime_to_ns(time);),
+	    TP_printk("id=%u delta=%llu time=%lld", __entry->id,
+		      __entry->delta, __entry->time));
+
+TRACE_EVENT(virtrtc_set_time,
+	    TP_PROTO(unsigned int id, ktime_t old_time, ktime_t new_time),
+	    TP_ARGS(id, old_time, new_time),
+	    TP_STRUCT__entry(__field(unsigned int, id) __field(s64, old_time)
+				     __field(s64, new_time)),
+	    TP_fast_assign(__entry->id = id;
+			   __entry->old_time = ktime_to_ns(old_time);
+			   __entry->new_time = ktime_to_ns(new_time);),
+	    TP_printk("id=%u old=%lld new=%lld", __entry->id,
+		      __entry->old_time, __entry->new_time));
+
+/* The guard timer has refreshed the given number of instances. */
+TRACE_EVENT(virtrtc_timer_expire,
+	    TP_PROTO(unsigned int refreshed, unsigned long next_due),
+	    TP_ARGS(refreshed, next_due),
+	    TP_STRUCT__entry(__field(unsigned int, refreshed)
+				     __field(unsigned long, next_due)),
+	    TP_fast_assign(__entry->refreshed = refreshed;
+			   __entry->next_due = next_due;),
+	    TP_printk("refreshed=%u next_due=%lu", __entry->refreshed,
+		      __entry->next_due));
+
+TRACE_EVENT(virtrtc_read_time,
+	    TP_PROTO(unsigned int id, ktime_t time, unsigned int retries),
+	    TP_ARGS(id, time, retries),
+	    TP_STRUCT__entry(__field(unsigned int, id) __field(s64, time)
+				     __field(unsigned int, retries)),
+	    TP_fast_assign(__entry->id = id;
+			   __entry->time = ktime_to_ns(time);
+			   __entry->retries = retries;),
+	    TP_printk("id=%u time=%lld retries=%u", __entry->id,
+		      __entry->time, __entry->retries));
+
+#endif /* VIRTRTC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE virtrtc_trace
+#include <trace/define_trace.h>
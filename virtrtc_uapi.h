@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/* Interface of the virtrtc module shared with userspace. */
+#ifndef VIRTRTC_UAPI_H
+#define VIRTRTC_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define VIRTRTC_TIMEBASE_JIFFIES 0
+#define VIRTRTC_TIMEBASE_MONO_FAST 1
+#define VIRTRTC_TIMEBASE_RAW 2
+#define VIRTRTC_TIMEBASE_REAL 3
+#define VIRTRTC_TIMEBASE_BOOT 4
+
+/* Read-only page published for every instance by /dev/virtrtc. The page of
+ * the instance N is mapped with the offset of N pages.
+ *
+ * The virtual time in nanoseconds is last_time plus the time elapsed since
+ * last_base, where last_base is taken from:
+ * - CLOCK_MONOTONIC for VIRTRTC_TIMEBASE_MONO_FAST;
+ * - CLOCK_MONOTONIC_RAW for VIRTRTC_TIMEBASE_RAW;
+ * - CLOCK_REALTIME for VIRTRTC_TIMEBASE_REAL;
+ * - CLOCK_BOOTTIME for VIRTRTC_TIMEBASE_BOOT.
+ * Jiffies are not visible to userspace, so for VIRTRTC_TIMEBASE_JIFFIES
+ * the elapsed time is CLOCK_MONOTONIC since last_mono instead. It's only
+ * accurate up to a jiffy.
+ * The elapsed time is scaled as (elapsed * mult) >> shift, with a 96-bit
+ * intermediate product.
+ *
+ * The fields are consistent if seq was even and didn't change while they
+ * were read:
+ *
+ *	do {
+ *		seq = READ_ONCE(page->seq);
+ *		rmb();
+ *		...copy the fields...
+ *		rmb();
+ *	} while ((seq & 1) || seq != READ_ONCE(page->seq));
+ */
+struct virtrtc_time_page {
+	__u32 seq;
+	__u32 timebase;
+	__s64 last_time;
+	__u64 last_base;
+	__u64 last_mono;
+	__u32 mult;
+	__u32 shift;
+};
+
+/* Batched access to many instances through ioctls on /dev/virtrtc.
+ *
+ * VIRTRTC_SET_TIMES sets the time of every listed instance and needs
+ * CAP_SYS_TIME. Entries are applied in order; on an error, the call fails
+ * and done tells how many entries were applied.
+ *
+ * VIRTRTC_GET_TIMES fills in the value of every listed instance. All values
+ * are taken at the same instant, and real is CLOCK_REALTIME at that instant.
+ *
+ * The value is in nanoseconds since the epoch, or since CLOCK_REALTIME with
+ * VIRTRTC_ENTRY_OFFSET. At most VIRTRTC_BATCH_MAX entries per call. */
+#define VIRTRTC_ENTRY_OFFSET 0x1
+
+#define VIRTRTC_BATCH_MAX 65536
+
+struct virtrtc_entry {
+	__u32 id;
+	__u32 flags;
+	__s64 value;
+};
+
+struct virtrtc_batch {
+	__u64 entries; /* Pointer to an array of struct virtrtc_entry. */
+	__u32 count;
+	__u32 done;
+	__s64 real;
+};
+
+#define VIRTRTC_IOC_MAGIC 0xB5
+#define VIRTRTC_SET_TIMES _IOWR(VIRTRTC_IOC_MAGIC, 0x01, struct virtrtc_batch)
+#define VIRTRTC_GET_TIMES _IOWR(VIRTRTC_IOC_MAGIC, 0x02, struct virtrtc_batch)
+
+/* Saved state of all the instances, read from and written to
+ * /sys/class/misc/virtrtc/state. A header is followed by a record per
+ * instance id, from 0 up to the highest existing one. Records of the ids
+ * without an instance are zeroed.
+ *
+ * Writing the blob back creates the missing instances and restores the
+ * others; records without VIRTRTC_STATE_PRESENT are skipped. A blob has
+ * to be written through one open file, starting with the header, and may be
+ * split anywhere on a record boundary. Reserved fields must be zero. If an
+ * instance created by the write can't be restored, it's destroyed again.
+ * The time is saved as an offset from CLOCK_REALTIME, so the time between
+ * the save and the restore counts as elapsed. */
+#define VIRTRTC_STATE_MAGIC 0x56525443 /* "VRTC" */
+#define VIRTRTC_STATE_VERSION 1
+
+#define VIRTRTC_STATE_PRESENT 0x1
+
+struct virtrtc_state_header {
+	__u32 magic;
+	__u32 version;
+	__u32 record_size;
+	__u32 reserved;
+	__s64 real; /* CLOCK_REALTIME when the header was read. */
+	__u64 reserved2;
+};
+
+struct virtrtc_state_record {
+	__u32 flags;
+	__u32 rate_num;
+	__u32 rate_den;
+	__s32 ppb;
+	__s64 offset;
+	__u64 reserved;
+};
+
+/* Timeline replayed by an instance, written to
+ * /sys/bus/platform/devices/virtrtc.N/replay/timeline. A header is followed by
+ * count points, and the replay starts once the last one is written. Writes
+ * go in order and may be split anywhere on a point boundary. A header with
+ * no points stops the replay.
+ *
+ * While replaying, the instance reads as the time of the points linearly
+ * interpolated: base is the time elapsed since the start of the replay, in
+ * nanoseconds of the time base, and has to increase from point to point.
+ * Before the first point the time stands still, after the last one it runs
+ * at the pace of the time base.
+ *
+ * Recorded sets of the time are read from .../replay/recording in the same
+ * format, with base counted from the start of the recording. Sets that
+ * read the same time base are a nanosecond apart, so a recording can be
+ * replayed as is. */
+#define VIRTRTC_TIMELINE_MAGIC 0x5652544c /* "VRTL" */
+#define VIRTRTC_TIMELINE_VERSION 1
+
+#define VIRTRTC_TIMELINE_MAX (1U << 22)
+
+struct virtrtc_timeline_header {
+	__u32 magic;
+	__u32 version;
+	__u32 count;
+	__u32 reserved; /* Must be 0. */
+};
+
+struct virtrtc_timeline_point {
+	__s64 base;
+	__s64 time;
+};
+
+/* Flight recorder of the reads and sets of all the instances. Every CPU has
+ * a ring of its own, mapped read-only from
+ * /sys/kernel/debug/virtrtc/flight/cpuN. The entries follow the header, and
+ * the entry number i, counting from the load, is entries[i % size].
+ *
+ * head is the number of entries written so far, and it's only raised after
+ * the entry is written. Entry i is intact if it was copied between two
+ * reads of head, h1 and h2, such that i < h1 and i + size > h2:
+ *
+ *	h1 = READ_ONCE(ring->head);
+ *	rmb();
+ *	...copy the entries from max(last, h1 - size) up to h1...
+ *	rmb();
+ *	h2 = READ_ONCE(ring->head);
+ *	...drop the copied entries up to h2 - size...
+ */
+#define VIRTRTC_FLIGHT_READ 0
+#define VIRTRTC_FLIGHT_SET 1
+
+struct virtrtc_flight_entry {
+	__u64 time; /* local_clock() of the CPU at the start, in nanoseconds. */
+	__u32 latency; /* In nanoseconds, saturated. */
+	__u32 pid; /* Process of the caller, in the initial namespace. */
+	__u32 id; /* Of the instance. */
+	__u16 op;
+	__u16 retries; /* Of the seqlock readers, saturated. */
+};
+
+struct virtrtc_flight_ring {
+	__u64 head;
+	__u32 size; /* A power of 2. */
+	__u32 entry_size;
+	__u64 reserved[6];
+	struct virtrtc_flight_entry entries[];
+};
+
+#endif /* VIRTRTC_UAPI_H */